@@ -1,6 +1,12 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <libguile.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/select.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Compatibility for old Guiles. */
 #ifndef SCM_VECTOR_LENGTH
@@ -74,6 +80,12 @@
 
 /* SMOB TYPES */
 
+/* Size of the smallest scratch arena.  Each arena that a primitive
+   moves on to is at least twice the size of the last, so it can never
+   outgrow more than XSCRATCH_MAX_OLD of them. */
+#define XSCRATCH_MIN_SIZE 4096
+#define XSCRATCH_MAX_OLD  (8 * sizeof (size_t))
+
 typedef struct xdisplay_t
 {
   /* The underlying Xlib display pointer. */
@@ -86,11 +98,87 @@ typedef struct xdisplay_t
 #define XDISPLAY_STATE_CLOSED       2
 #define XDISPLAY_STATE_ANY          ( XDISPLAY_STATE_OPEN | XDISPLAY_STATE_CLOSED )
 
-  /* Cached default gc smob for this display. */
-  SCM gc;
+  /* Cached default gc and screen smobs for each of the display's
+     NUM_SCREENS screens, or #f where not yet made. */
+  int num_screens;
+  SCM *gcs;
+  SCM *screens;
+
+  /* Pool of shared GCs handed out by x-acquire-gc!: POOL_COUNT
+     entries, with room for POOL_SIZE.  Entries no longer in use are
+     kept, up to POOL_MAX of them, until they are the least recently
+     used. */
+  struct xgcpool_entry_t *pool;
+  int pool_count;
+  int pool_size;
+  int pool_max;
+  unsigned long pool_clock;
+
+  /* Maximum request length in 4-byte units, including BIG-REQUESTS
+     if the server supports it, or 0 if not yet known. */
+  long max_request;
+
+  /* Nonzero if requests longer than XMaxRequestSize are sent using
+     BIG-REQUESTS, which adds one unit to each request header. */
+  int bigreq;
+
+  /* Scratch arena, from which primitives take their temporary
+     buffers: SCRATCH_USED of its SCRATCH_SIZE bytes are taken.  It is
+     reset at the start of each primitive.  A primitive that needs
+     more moves on to an arena twice the size, keeping the arenas it
+     outgrew in SCRATCH_OLD until the reset; the arena is then made
+     big enough for SCRATCH_PEAK, the most any primitive has taken in
+     all. */
+  char *scratch;
+  size_t scratch_size;
+  size_t scratch_used;
+  size_t scratch_taken;
+  size_t scratch_peak;
+  char *scratch_old[XSCRATCH_MAX_OLD];
+  size_t scratch_old_size[XSCRATCH_MAX_OLD];
+  int scratch_num_old;
+
+  /* Number of scratch buffers taken, and number of allocations from
+     the collector made for the arena. */
+  unsigned long scratch_allocs;
+  unsigned long scratch_gc_allocs;
+
+  /* Advanced whenever a window, pixmap or GC on the display is
+     destroyed or freed, or the display closed, so that draw contexts
+     know to validate theirs again. */
+  unsigned long epoch;
+
+  /* Kinds of event that x-next-event! and x-next-events! compress. */
+  int compress;
+
+#define XCOMPRESS_MOTION            1
+#define XCOMPRESS_EXPOSE            2
+#define XCOMPRESS_CONFIGURE         4
+
+  /* Event handlers set with x-set-event-handler!, in an open hash
+     table of HANDLERS_SIZE entries keyed by window and event type.
+     HANDLERS_USED entries are in use or have been deleted. */
+  struct xhandler_t *handlers;
+  int handlers_size;
+  int handlers_used;
 
 } xdisplay_t;
 
+typedef struct xhandler_t
+{
+  /* The window the events are reported to, and their type, or
+     XHANDLER_EMPTY or XHANDLER_DELETED. */
+  Window win;
+  int type;
+
+#define XHANDLER_EMPTY              0
+#define XHANDLER_DELETED            1
+
+  /* The procedure called with each such event. */
+  SCM proc;
+
+} xhandler_t;
+
 typedef struct xscreen_t
 {
   /* The display that this screen is on. */
@@ -118,6 +206,11 @@ typedef struct xwindow_t
 #define XWINDOW_STATE_THIRD_PARTY   8
 #define XWINDOW_STATE_PIXMAP        16
 
+  /* Root window and depth of the drawable, or a depth of 0 if they
+     are not yet known. */
+  Window root;
+  int depth;
+
 } xwindow_t;
 
 typedef struct xgc_t
@@ -134,9 +227,132 @@ typedef struct xgc_t
 #define XGC_STATE_DEFAULT           1
 #define XGC_STATE_CREATED           2
 #define XGC_STATE_FREED             4
+#define XGC_STATE_POOLED            8
+
+  /* Transform applied to the coordinates of drawings made with this
+     GC, or #f. */
+  SCM transform;
+
+  /* Shadow copy of the GC's values, and the mask of the fields whose
+     values are known to be those of the GC. */
+  XGCValues values;
+  unsigned long known;
+
+  /* The pixmap and font smobs last given for the tile, stipple, font
+     and clip mask, or #f.  Holding them keeps their IDs from being
+     freed and reused while the shadow values still name them. */
+  SCM objs[4];
+
+#define XGC_OBJ_TILE                0
+#define XGC_OBJ_STIPPLE             1
+#define XGC_OBJ_FONT                2
+#define XGC_OBJ_CLIP_MASK           3
+#define XGC_NUM_OBJS                4
 
 } xgc_t;
 
+typedef struct xfont_t
+{
+  /* The display that this font is loaded on. */
+  SCM dsp;
+
+  /* The underlying Xlib font ID. */
+  Font font;
+
+  /* State - loaded/unloaded. */
+  int state;
+
+#define XFONT_STATE_LOADED          1
+#define XFONT_STATE_UNLOADED        2
+
+} xfont_t;
+
+/* A list of GC fields, checked once so that values for them can be
+   applied to GCs repeatedly. */
+typedef struct xgcspec_t
+{
+  /* Value mask of the fields. */
+  unsigned long mask;
+
+  /* Field numbers, in the order their values are given. */
+  int count;
+  unsigned char fields[23];
+
+} xgcspec_t;
+
+/* A GC in a display's GC pool, with the values it was created with. */
+typedef struct xgcpool_entry_t
+{
+  /* The gc smob. */
+  SCM gc;
+
+  /* Root and depth of the drawables it can be used with. */
+  Window root;
+  int depth;
+
+  /* Values it was created with. */
+  unsigned long mask;
+  XGCValues values;
+
+  /* Number of x-acquire-gc! calls not yet matched by x-release-gc!,
+     and the value of the pool clock when it was last acquired. */
+  int refs;
+  unsigned long last_use;
+
+} xgcpool_entry_t;
+
+#define XGCPOOL_DEFAULT_MAX   32
+
+typedef struct xdlist_t
+{
+  /* The display that the recorded GCs and drawables belong to, or #f
+     while nothing has been recorded. */
+  SCM dsp;
+
+  /* Recorded operations, packed end to end. */
+  char *ops;
+  size_t used;
+  size_t size;
+  int num_ops;
+
+  /* GCs and source drawables used by the recorded operations. */
+  struct xdlist_obj_t *objs;
+  int num_objs;
+  int max_objs;
+
+} xdlist_t;
+
+typedef struct xdctx_t
+{
+  /* The drawable and GC that the context draws with. */
+  SCM drawable;
+  SCM gc;
+
+  /* Their display and Xlib structures, as last validated, which hold
+     for as long as the display's epoch is EPOCH. */
+  xdisplay_t *dsp;
+  xwindow_t *win;
+  xgc_t *gc1;
+  unsigned long epoch;
+
+} xdctx_t;
+
+typedef struct xevent_t
+{
+  /* The display that the event came from, or #f while none has been
+     stored. */
+  SCM dsp;
+
+  /* The event as Xlib delivered it. */
+  XEvent e;
+
+  /* An event vector of all its fields, or #f if none has been needed
+     yet, and whether it holds the fields of this event. */
+  SCM vector;
+  int decoded;
+
+} xevent_t;
+
 
 /* DECLARATIONS */
 
@@ -144,17 +360,161 @@ int scm_tc16_xdisplay = 0;
 int scm_tc16_xscreen = 0;
 int scm_tc16_xwindow = 0;
 int scm_tc16_xgc = 0;
+int scm_tc16_xfont = 0;
+int scm_tc16_xdlist = 0;
+int scm_tc16_xtransform = 0;
+int scm_tc16_xgeom = 0;
+int scm_tc16_xgcspec = 0;
+int scm_tc16_xdctx = 0;
+int scm_tc16_xevent = 0;
 
 SCM resource_id_hash;
 
 #define XDISPLAY(display) ((xdisplay_t *) SCM_SMOB_DATA (display))
 #define XSCREEN(screen)   ((xscreen_t *) SCM_SMOB_DATA (screen))
+#define XDLIST(dlist)     ((xdlist_t *) SCM_SMOB_DATA (dlist))
+#define XTRANSFORM(xf)    ((xform_t *) SCM_SMOB_DATA (xf))
+#define XGEOM(geom)       ((xgeom_t *) SCM_SMOB_DATA (geom))
+#define XGCSPEC(spec)     ((xgcspec_t *) SCM_SMOB_DATA (spec))
+#define XGC(gc)           ((xgc_t *) SCM_SMOB_DATA (gc))
+#define XDCTX(ctx)        ((xdctx_t *) SCM_SMOB_DATA (ctx))
+#define XEVENT(event)     ((xevent_t *) SCM_SMOB_DATA (event))
 
 #define XDATA_ARCS            0
 #define XDATA_LINES           1
 #define XDATA_POINTS          2
 #define XDATA_SEGMENTS        3
 #define XDATA_RECTANGLES      4
+#define XDATA_FILL_ARCS       5
+#define XDATA_FILL_POLYGON    6
+#define XDATA_FILL_RECTANGLES 7
+
+#define XDATA_NUM_TYPES       8
+
+/* Drawing data as prepared by valid_data.  DATA points either
+   straight into the Scheme object's storage or, if its layout does
+   not match the Xlib structures, to a converted copy; release_data
+   undoes whatever valid_data did. */
+typedef struct xdata_t
+{
+  /* Xlib structures, ready to be passed to Xlib. */
+  void *data;
+
+  /* Number of structures at DATA. */
+  int count;
+
+  /* Size of the converted copy, or 0 if DATA is not a copy or is in
+     SCRATCH. */
+  size_t allocated;
+
+  /* The display whose scratch arena any other storage is taken from. */
+  xdisplay_t *dsp;
+
+  /* Storage supplied by the caller, which a converted copy uses
+     instead of being allocated if it fits, or NULL. */
+  void *scratch;
+  size_t scratch_size;
+
+  /* Handle on the Scheme array, held until the data has been used. */
+  scm_t_array_handle handle;
+  int handlep;
+
+  /* If not NULL, the data are drawn as NUM_RUNS separate runs, of
+     RUNS[0], RUNS[1]... data each.  Used for polylines that have been
+     broken up by clipping. */
+  int *runs;
+  int num_runs;
+
+} xdata_t;
+
+/* An affine transformation of drawing coordinates:
+
+     x' = xx * x + xy * y + x0
+     y' = yx * x + yy * y + y0  */
+typedef struct xform_t
+{
+  double xx, yx;
+  double xy, yy;
+  double x0, y0;
+
+} xform_t;
+
+typedef struct xgeom_t
+{
+  /* Packed shorts, shorts_per_datum[KIND] per datum. */
+  short *data;
+
+  /* Number of data held, and room for. */
+  size_t count;
+  size_t size;
+
+  /* XDATA_ARCS, XDATA_POINTS, XDATA_SEGMENTS or XDATA_RECTANGLES,
+     according to what has been pushed. */
+  int kind;
+
+} xgeom_t;
+
+typedef struct draw_options_t
+{
+  /* Nonzero if data outside XMIN..XMAX, YMIN..YMAX (inclusive) are to
+     be culled before drawing. */
+  int boundsp;
+  int xmin, ymin, xmax, ymax;
+
+  /* Nonzero if a polyline is to be reduced to the first, last, lowest
+     and highest points of each pixel column. */
+  int decimate;
+
+  /* If positive, the distance in pixels within which a polyline is
+     simplified. */
+  double tolerance;
+
+  /* Nonzero if the coordinates are to be mapped through TRANSFORM
+     as they are converted. */
+  int transformp;
+  xform_t transform;
+
+  /* Nonzero if each point of the data is relative to the one before,
+     as with CoordModePrevious. */
+  int relative;
+
+  /* Coordinate mode in which points are sent to the server. */
+  int mode;
+
+} draw_options_t;
+
+/* A drawing passed to x-draw-batch!, and a group of them drawn
+   together. */
+typedef struct batch_item_t
+{
+  /* The drawing's GC, and its index in a display list's object table
+     when recording. */
+  SCM gc;
+  int gc_index;
+
+  /* XDATA_* type, and the converted data. */
+  int type;
+  xdata_t xd;
+
+  /* Bounding box of everything the drawing can touch: xmin, ymin,
+     xmax, ymax. */
+  int bbox[4];
+
+  /* Next item in the same group, or -1. */
+  int next;
+
+} batch_item_t;
+
+typedef struct batch_group_t
+{
+  /* First and last items, and the total number of data. */
+  int first, last;
+  int count;
+
+  /* Union of the bounding boxes of the items. */
+  int bbox[4];
+
+} batch_group_t;
 
 static int xdisplay_print (SCM display, SCM port, scm_print_state *pstate);
 static size_t xdisplay_free (SCM display);
@@ -199,6 +559,11 @@ SCM scm_x_screen_number_of_screen (SCM screen);
 SCM scm_x_min_colormaps (SCM display, SCM screen);
 SCM scm_x_max_colormaps (SCM display, SCM screen);
 
+static void scratch_reset (xdisplay_t *dsp, const char *func);
+static void * scratch_alloc (xdisplay_t *dsp, size_t size, const char *func);
+
+SCM scm_x_scratch_statistics (SCM display);
+
 static int xwindow_print (SCM window, SCM port, scm_print_state *pstate);
 static size_t xwindow_free (SCM window);
 static SCM xwindow_mark (SCM window);
@@ -212,12 +577,24 @@ SCM scm_x_clear_window_x (SCM window);
 SCM scm_x_clear_area_x (SCM window, SCM x, SCM y, SCM width, SCM height, SCM exposures);
 
 SCM scm_x_create_pixmap_x (SCM display, SCM screen, SCM width, SCM height, SCM depth);
+SCM scm_x_free_pixmap_x (SCM pixmap);
 SCM scm_x_copy_area_x (SCM source, SCM destination, SCM gc, SCM src_x, SCM src_y, SCM width, SCM height, SCM dst_x, SCM dst_y);
 
+static int xfont_print (SCM font, SCM port, scm_print_state *pstate);
+static size_t xfont_free (SCM font);
+static SCM xfont_mark (SCM font);
+static xfont_t * valid_font (SCM arg, int pos, int expected, const char *func);
+
+SCM scm_x_load_font_x (SCM display, SCM name);
+SCM scm_x_unload_font_x (SCM font);
+
 static int xgc_print (SCM window, SCM port, scm_print_state *pstate);
 static size_t xgc_free (SCM gc);
 static SCM xgc_mark (SCM gc);
 static xgc_t * valid_gc (SCM arg, int pos, int expected, const char *func);
+static void prime_gc_shadow (xdisplay_t *dsp, xgc_t *gc1);
+static void note_gc_values (xgc_t *gc1, unsigned long mask, XGCValues *gcv, SCM *objs);
+static void change_gc (xdisplay_t *dsp, xgc_t *gc1, unsigned long mask, XGCValues *gcv, SCM *objs);
 
 SCM scm_x_default_gc (SCM display, SCM screen);
 SCM scm_x_free_gc_x (SCM gc);
@@ -226,18 +603,120 @@ SCM scm_x_change_gc_x (SCM gc, SCM changes);
 SCM scm_x_set_dashes_x (SCM gc, SCM offset, SCM dashes);
 SCM scm_x_set_clip_rectangles_x (SCM gc, SCM x, SCM y, SCM rectangles, SCM ordering);
 SCM scm_x_copy_gc_x (SCM src, SCM dst, SCM fields);
-
-static void * valid_data (SCM arg, int pos, int type, int *allocatedp, int *count, const char *func);
-static SCM draw (SCM window, SCM gc, SCM data, int type, const char *func);
-
-SCM scm_x_draw_arcs_x (SCM window, SCM gc, SCM arcs);
-SCM scm_x_draw_lines_x (SCM window, SCM gc, SCM points);
-SCM scm_x_draw_points_x (SCM window, SCM gc, SCM points);
-SCM scm_x_draw_segments_x (SCM window, SCM gc, SCM segments);
-SCM scm_x_draw_rectangles_x (SCM window, SCM gc, SCM rectangles);
+static SCM gc_field_value (xdisplay_t *dsp, xgc_t *gc1, int fld);
+SCM scm_x_get_gc_values (SCM gc, SCM spec, SCM vector);
+
+static int xgcspec_print (SCM spec, SCM port, scm_print_state *pstate);
+static xgcspec_t * valid_gcspec (SCM arg, int pos, const char *func);
+
+SCM scm_x_make_gc_spec (SCM fields);
+SCM scm_x_apply_gc_spec_x (SCM gc, SCM spec, SCM value1, SCM value2, SCM value3, SCM value4);
+
+static void drawable_root_depth (xdisplay_t *dsp, xwindow_t *win);
+static int gc_values_equal (unsigned long mask, XGCValues *a, XGCValues *b);
+static int gc_objs_equal (unsigned long mask, SCM *a, SCM *b);
+static void trim_gc_pool (xdisplay_t *dsp);
+
+SCM scm_x_acquire_gc_x (SCM drawable, SCM changes);
+SCM scm_x_release_gc_x (SCM gc);
+SCM scm_x_set_gc_pool_size_x (SCM display, SCM size);
+
+static int xtransform_print (SCM xf, SCM port, scm_print_state *pstate);
+static xform_t * valid_transform (SCM arg, int pos, const char *func);
+
+SCM scm_x_make_transform (void);
+SCM scm_x_transform_set_x (SCM xf, SCM xx, SCM yx, SCM xy, SCM yy, SCM x0, SCM y0);
+SCM scm_x_transform_identity_x (SCM xf);
+SCM scm_x_transform_translate_x (SCM xf, SCM tx, SCM ty);
+SCM scm_x_transform_scale_x (SCM xf, SCM sx, SCM sy);
+SCM scm_x_transform_rotate_x (SCM xf, SCM angle);
+SCM scm_x_transform_to_vector (SCM xf);
+SCM scm_x_set_gc_transform_x (SCM gc, SCM xf);
+
+static void valid_data (SCM arg, int pos, int type, const xform_t *xform, xdisplay_t *dsp, xdata_t *xd, const char *func);
+static void valid_data_scratch (SCM arg, int pos, int type, const xform_t *xform, int relative, void *scratch, size_t scratch_size, xdisplay_t *dsp, xdata_t *xd, const char *func);
+static void * copy_storage (xdata_t *xd, size_t size, const char *func);
+static void release_data (xdata_t *xd, const char *func);
+static void draw_data (xdisplay_t *dsp, Drawable d, GC gc, int type, void *dat, int num_data, int shape, int mode, const char *func);
+static void parse_draw_options (SCM options, int type, draw_options_t *opts, const char *func);
+static void decimate_lines (xdata_t *xd, const char *func);
+static void simplify_lines (xdata_t *xd, double tolerance, const char *func);
+static void cull_data (xdata_t *xd, int type, const draw_options_t *opts, const char *func);
+static SCM draw (SCM window, SCM gc, SCM data, int type, int shape, SCM options, const char *func);
+static SCM draw_valid (xdisplay_t *dsp, xwindow_t *win, xdlist_t *dl, xgc_t *gc1, int gc_index, SCM data, int type, int shape, SCM options, const char *func);
+
+SCM scm_x_draw_arcs_x (SCM window, SCM gc, SCM arcs, SCM options);
+SCM scm_x_draw_lines_x (SCM window, SCM gc, SCM points, SCM options);
+SCM scm_x_draw_points_x (SCM window, SCM gc, SCM points, SCM options);
+SCM scm_x_draw_segments_x (SCM window, SCM gc, SCM segments, SCM options);
+SCM scm_x_draw_rectangles_x (SCM window, SCM gc, SCM rectangles, SCM options);
+SCM scm_x_fill_arcs_x (SCM window, SCM gc, SCM arcs, SCM options);
+SCM scm_x_fill_polygon_x (SCM window, SCM gc, SCM points, SCM shape, SCM options);
+SCM scm_x_fill_rectangles_x (SCM window, SCM gc, SCM rectangles, SCM options);
+
+static int batch_type (SCM sym, const char *func);
+static void extend_bbox (int *bbox, int x0, int y0, int x1, int y1);
+static void batch_bbox (batch_item_t *item);
+static int bbox_overlap (const int *a, const int *b);
+
+SCM scm_x_draw_batch_x (SCM window, SCM items);
+
+static int xdctx_print (SCM ctx, SCM port, scm_print_state *pstate);
+static SCM xdctx_mark (SCM ctx);
+static void validate_dctx (xdctx_t *ctx, int pos, const char *func);
+
+SCM scm_x_make_draw_context (SCM drawable, SCM gc);
+SCM scm_x_draw_context_set_gc_x (SCM context, SCM gc);
+SCM scm_x_context_draw_x (SCM context, SCM type, SCM data, SCM options);
+
+static int xgeom_print (SCM geom, SCM port, scm_print_state *pstate);
+static xgeom_t * valid_geom (SCM arg, int pos, const char *func);
+static short * geom_push (xgeom_t *geom, int kind, const char *func);
+
+SCM scm_x_make_geometry_buffer (SCM size);
+SCM scm_x_geometry_buffer_push_point_x (SCM geom, SCM x, SCM y);
+SCM scm_x_geometry_buffer_push_segment_x (SCM geom, SCM x1, SCM y1, SCM x2, SCM y2);
+SCM scm_x_geometry_buffer_push_rectangle_x (SCM geom, SCM x, SCM y, SCM width, SCM height);
+SCM scm_x_geometry_buffer_push_arc_x (SCM geom, SCM x, SCM y, SCM width, SCM height, SCM angle1, SCM angle2);
+SCM scm_x_geometry_buffer_reset_x (SCM geom);
+SCM scm_x_geometry_buffer_length (SCM geom);
+
+static int xdlist_print (SCM dlist, SCM port, scm_print_state *pstate);
+static SCM xdlist_mark (SCM dlist);
+static int dlist_object (xdlist_t *dl, SCM obj, SCM display, const char *func);
+static void record_data (xdlist_t *dl, int gc, int type, void *dat, int num_data, int shape, int mode, const char *func);
+static SCM record_copy_area (SCM dlist, SCM source, SCM gc, int src_x, int src_y, unsigned int width, unsigned int height, int dst_x, int dst_y, const char *func);
+
+SCM scm_x_make_display_list (void);
+SCM scm_x_display_list_clear_x (SCM dlist);
+SCM scm_x_display_list_change_gc_x (SCM dlist, SCM gc, SCM changes);
+SCM scm_x_display_list_replay_x (SCM dlist, SCM drawable);
 
 static SCM copy_event_fields (SCM display, XEvent *e, SCM event, const char *func);
 static SCM lookup_window (SCM display, XID id, const char *func);
+static void validate_event_arg (SCM event, int pos, const char *func);
+static int xevent_print (SCM event, SCM port, scm_print_state *pstate);
+static SCM xevent_mark (SCM event);
+static SCM store_event (SCM display, XEvent *e, SCM event, const char *func);
+static SCM event_window (xevent_t *ev, const char *func);
+
+SCM scm_x_make_raw_event (void);
+SCM scm_x_event_ref (SCM event, SCM slot);
+
+static void compress_event (xdisplay_t *dsp, XEvent *e);
+
+SCM scm_x_set_event_compression_x (SCM display, SCM kinds);
+
+static xhandler_t * event_handler_slot (xdisplay_t *dsp, Window win, int type);
+static SCM find_event_handler (xdisplay_t *dsp, Window win, int type);
+static void remove_event_handlers (xdisplay_t *dsp, Window win);
+
+SCM scm_x_set_event_handler_x (SCM window, SCM type, SCM proc);
+SCM scm_x_dispatch_events_x (SCM display, SCM event);
+
+static int valid_queued_mode (SCM mode, int pos, int dflt, const char *func);
+static void wait_for_input (SCM arg, int pos, const char *func);
+static void wait_for_event (SCM arg, int pos, const char *func);
 
 SCM scm_x_check_mask_event_x (SCM display, SCM mask, SCM event);
 SCM scm_x_check_typed_event_x (SCM display, SCM type, SCM event);
@@ -247,6 +726,7 @@ SCM scm_x_events_queued_x (SCM display, SCM mode);
 SCM scm_x_pending_x (SCM display);
 SCM scm_x_mask_event_x (SCM display, SCM mask, SCM event);
 SCM scm_x_next_event_x (SCM display, SCM event);
+SCM scm_x_next_events_x (SCM display, SCM events, SCM mode);
 SCM scm_x_peek_event_x (SCM display, SCM event);
 SCM scm_x_select_input_x (SCM window, SCM mask);
 SCM scm_x_window_event_x (SCM window, SCM mask, SCM event);
@@ -289,12 +769,27 @@ static size_t xdisplay_free (SCM display)
   return 0;
 }
 
-/* Smob mark hook for displays: mark the default GC. */
+/* Smob mark hook for displays: mark the default GCs, the screens, the
+   GC pool and the event handlers. */
 static SCM xdisplay_mark (SCM display)
 {
   xdisplay_t *dsp = (xdisplay_t *) SCM_SMOB_DATA (display);
+  int i;
+
+  for (i = 0; i < dsp->num_screens; i++)
+    {
+      scm_gc_mark (dsp->gcs[i]);
+      scm_gc_mark (dsp->screens[i]);
+    }
 
-  return dsp->gc;
+  for (i = 0; i < dsp->pool_count; i++)
+    scm_gc_mark (dsp->pool[i].gc);
+
+  for (i = 0; i < dsp->handlers_size; i++)
+    if (dsp->handlers[i].type > XHANDLER_DELETED)
+      scm_gc_mark (dsp->handlers[i].proc);
+
+  return SCM_BOOL_F;
 }
 
 static SCM valid_dsp (SCM arg, int pos, int expected, const char *func)
@@ -312,6 +807,8 @@ static SCM valid_dsp (SCM arg, int pos, int expected, const char *func)
     arg1 = ((xwindow_t *) SCM_SMOB_DATA (arg1))->dsp;
   else if (SCM_TYP16 (arg1) == scm_tc16_xgc)
     arg1 = ((xgc_t *) SCM_SMOB_DATA (arg1))->dsp;
+  else if (SCM_TYP16 (arg1) == scm_tc16_xfont)
+    arg1 = ((xfont_t *) SCM_SMOB_DATA (arg1))->dsp;
 
   if (SCM_TYP16 (arg1) == scm_tc16_xdisplay)
     dsp = XDISPLAY (arg1);
@@ -355,7 +852,7 @@ static int valid_scr (SCM display, SCM screen, int pos, xdisplay_t *dsp, const c
     scr = XScreenNumberOfScreen (((xscreen_t *) SCM_SMOB_DATA (display))->scr);
   else if (!SCM_UNBNDP (screen))
     {
-      SCM_ASSERT (scm_to_int (screen), screen, pos, func);
+      SCM_ASSERT (scm_is_integer (screen), screen, pos, func);
       scr = scm_to_int (screen);
       SCM_ASSERT_RANGE (SCM_ARG2,
                         screen,
@@ -379,6 +876,7 @@ SCM_DEFINE (scm_x_open_display_x, "x-open-display!", 0, 1, 0,
 {
   char *dsparg = NULL;
   xdisplay_t *dsp;
+  int i;
 
   if (!SCM_UNBNDP (host))
     {
@@ -389,7 +887,29 @@ SCM_DEFINE (scm_x_open_display_x, "x-open-display!", 0, 1, 0,
   dsp = scm_gc_malloc (sizeof (xdisplay_t), FUNC_NAME);
 
   dsp->state = XDISPLAY_STATE_OPEN;
-  dsp->gc    = SCM_BOOL_F;
+  dsp->num_screens = 0;
+  dsp->gcs   = NULL;
+  dsp->screens = NULL;
+  dsp->pool  = NULL;
+  dsp->pool_count = 0;
+  dsp->pool_size = 0;
+  dsp->pool_max = XGCPOOL_DEFAULT_MAX;
+  dsp->pool_clock = 0;
+  dsp->max_request = 0;
+  dsp->bigreq = 0;
+  dsp->scratch = NULL;
+  dsp->scratch_size = 0;
+  dsp->scratch_used = 0;
+  dsp->scratch_taken = 0;
+  dsp->scratch_peak = 0;
+  dsp->scratch_num_old = 0;
+  dsp->scratch_allocs = 0;
+  dsp->scratch_gc_allocs = 0;
+  dsp->epoch = 0;
+  dsp->compress = 0;
+  dsp->handlers = NULL;
+  dsp->handlers_size = 0;
+  dsp->handlers_used = 0;
   dsp->dsp   = XOpenDisplay (dsparg);
 
   if (dsp->dsp == NULL)
@@ -400,6 +920,14 @@ SCM_DEFINE (scm_x_open_display_x, "x-open-display!", 0, 1, 0,
                       scm_list_1 (host));
     }
 
+  /* The screen count comes with the connection setup, so no request
+     is needed to size the per-screen caches. */
+  dsp->num_screens = ScreenCount (dsp->dsp);
+  dsp->gcs = scm_gc_malloc (dsp->num_screens * sizeof (SCM), FUNC_NAME);
+  dsp->screens = scm_gc_malloc (dsp->num_screens * sizeof (SCM), FUNC_NAME);
+  for (i = 0; i < dsp->num_screens; i++)
+    dsp->gcs[i] = dsp->screens[i] = SCM_BOOL_F;
+
   SCM_RETURN_NEWSMOB (scm_tc16_xdisplay, dsp);
 }
 #undef FUNC_NAME
@@ -414,8 +942,12 @@ SCM_DEFINE (scm_x_close_display_x, "x-close-display!", 1, 0, 0,
   dsp = XDISPLAY (valid_dsp (display, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
 
   dsp->state = XDISPLAY_STATE_CLOSED;
+  dsp->epoch++;
   XCloseDisplay (dsp->dsp);
 
+  /* Closing the display freed the pooled GCs. */
+  dsp->pool_count = 0;
+
   return SCM_UNSPECIFIED;
 }
 #undef FUNC_NAME
@@ -857,12 +1389,18 @@ SCM_DEFINE (scm_x_screen_of_display, "x-screen-of-display", 1, 1, 0,
   dsp = XDISPLAY (display1);
   scr = valid_scr (display, screen, SCM_ARG2, dsp, FUNC_NAME);
 
-  scr1 = scm_gc_malloc (sizeof (xscreen_t), FUNC_NAME);
+  if (scm_is_false (dsp->screens[scr]))
+    {
+      /* Create and cache screen smob. */
+      scr1 = scm_gc_malloc (sizeof (xscreen_t), FUNC_NAME);
+
+      scr1->scr = XScreenOfDisplay (dsp->dsp, scr);
+      scr1->dsp = display1;
 
-  scr1->scr = XScreenOfDisplay (dsp->dsp, scr);
-  scr1->dsp = display1;
+      SCM_NEWSMOB (dsp->screens[scr], scm_tc16_xscreen, scr1);
+    }
 
-  SCM_RETURN_NEWSMOB (scm_tc16_xscreen, scr1);
+  return dsp->screens[scr];
 }
 #undef FUNC_NAME
 
@@ -912,6 +1450,113 @@ SCM_DEFINE (scm_x_max_colormaps, "x-max-colormaps", 1, 1, 0,
 }
 #undef FUNC_NAME
 
+/* Round SIZE up to keep scratch buffers aligned for any of the
+   structures and numbers kept in them. */
+#define XSCRATCH_ALIGN(size) (((size) + 15) & ~((size_t) 15))
+
+/* Start a primitive's use of DSP's scratch arena: everything taken
+   from it before is given back, even if the primitive that took it
+   exited non-locally.  If the arena had to be outgrown, it is
+   replaced by one big enough for the most taken so far, so that in
+   steady state the collector is not involved at all. */
+static void scratch_reset (xdisplay_t *dsp, const char *func)
+{
+  size_t size;
+
+  while (dsp->scratch_num_old > 0)
+    {
+      dsp->scratch_num_old--;
+      scm_gc_free (dsp->scratch_old[dsp->scratch_num_old],
+                   dsp->scratch_old_size[dsp->scratch_num_old],
+                   func);
+      dsp->scratch_old[dsp->scratch_num_old] = NULL;
+    }
+
+  dsp->scratch_used = 0;
+  dsp->scratch_taken = 0;
+
+  if (dsp->scratch_peak > dsp->scratch_size)
+    {
+      for (size = XSCRATCH_MIN_SIZE; size < dsp->scratch_peak; size *= 2)
+        ;
+
+      if (dsp->scratch)
+        scm_gc_free (dsp->scratch, dsp->scratch_size, func);
+      dsp->scratch = NULL;
+      dsp->scratch_size = 0;
+
+      dsp->scratch = scm_gc_malloc_pointerless (size, func);
+      dsp->scratch_size = size;
+      dsp->scratch_gc_allocs++;
+    }
+}
+
+/* Return SIZE bytes of scratch storage from DSP's arena.  It stays
+   valid until the next scratch_reset, and is not freed on its own. */
+static void * scratch_alloc (xdisplay_t *dsp, size_t size, const char *func)
+{
+  size = XSCRATCH_ALIGN (size ? size : 1);
+
+  dsp->scratch_allocs++;
+  dsp->scratch_taken += size;
+  if (dsp->scratch_taken > dsp->scratch_peak)
+    dsp->scratch_peak = dsp->scratch_taken;
+
+  if (size > dsp->scratch_size - dsp->scratch_used)
+    {
+      /* Move on to a bigger arena, keeping the one outgrown until the
+         reset, as what was taken from it may still be in use. */
+      size_t new_size = dsp->scratch_size ? 2 * dsp->scratch_size : XSCRATCH_MIN_SIZE;
+
+      while (new_size < size)
+        new_size *= 2;
+
+      if (dsp->scratch)
+        {
+          dsp->scratch_old[dsp->scratch_num_old] = dsp->scratch;
+          dsp->scratch_old_size[dsp->scratch_num_old] = dsp->scratch_size;
+          dsp->scratch_num_old++;
+        }
+      dsp->scratch = NULL;
+      dsp->scratch_size = 0;
+      dsp->scratch_used = 0;
+
+      dsp->scratch = scm_gc_malloc_pointerless (new_size, func);
+      dsp->scratch_size = new_size;
+      dsp->scratch_gc_allocs++;
+    }
+
+  dsp->scratch_used += size;
+
+  return dsp->scratch + dsp->scratch_used - size;
+}
+
+SCM_DEFINE (scm_x_scratch_statistics, "x-scratch-statistics", 1, 0, 0,
+            (SCM display),
+            "Return a vector describing the scratch storage that drawing\n"
+            "procedures on @var{display} use for temporary buffers:\n"
+            "the number of buffers taken from it, the number of\n"
+            "allocations from the garbage collector made for it, its\n"
+            "size, and the most storage any one procedure has needed.\n"
+            "The counts are totals since the display was opened; once\n"
+            "the storage has grown to what a program needs, drawing\n"
+            "allocates nothing more from the collector.")
+#define FUNC_NAME s_scm_x_scratch_statistics
+{
+  xdisplay_t *dsp;
+  SCM v = scm_c_make_vector (4, SCM_BOOL_F);
+
+  dsp = XDISPLAY (valid_dsp (display, SCM_ARG1, XDISPLAY_STATE_ANY, FUNC_NAME));
+
+  scm_c_vector_set_x (v, 0, scm_from_ulong (dsp->scratch_allocs));
+  scm_c_vector_set_x (v, 1, scm_from_ulong (dsp->scratch_gc_allocs));
+  scm_c_vector_set_x (v, 2, scm_from_size_t (dsp->scratch_size));
+  scm_c_vector_set_x (v, 3, scm_from_size_t (dsp->scratch_peak));
+
+  return v;
+}
+#undef FUNC_NAME
+
 
 /* WINDOWS */
 
@@ -957,9 +1602,14 @@ size_t xwindow_free (SCM window)
 
   /* Only destroy this window if the display is still valid. */
   if ((SCM_TYP16 (win->dsp) == scm_tc16_xdisplay) &&
-      (win->state != XWINDOW_STATE_DESTROYED) &&
-      (win->state != XWINDOW_STATE_THIRD_PARTY))
-    scm_x_destroy_window_x (window);
+      (XDISPLAY (win->dsp)->state == XDISPLAY_STATE_OPEN))
+    {
+      if (win->state == XWINDOW_STATE_PIXMAP)
+        scm_x_free_pixmap_x (window);
+      else if ((win->state != XWINDOW_STATE_DESTROYED) &&
+               (win->state != XWINDOW_STATE_THIRD_PARTY))
+        scm_x_destroy_window_x (window);
+    }
 
   return 0;
 }
@@ -1048,6 +1698,8 @@ SCM_DEFINE (scm_x_create_window_x, "x-create-window!", 1, 0, 0,
 
   win->state = XWINDOW_STATE_UNMAPPED;
   win->dsp = display1;
+  win->root = DefaultRootWindow (dsp->dsp);
+  win->depth = DefaultDepth (dsp->dsp, screen);
   win->win = XCreateWindow (dsp->dsp,
                             DefaultRootWindow (dsp->dsp),
                             0,
@@ -1130,8 +1782,12 @@ SCM_DEFINE (scm_x_destroy_window_x, "x-destroy-window!", 1, 0, 0,
 				       XWINDOW_STATE_PIXMAP), FUNC_NAME);
 
   win->state = XWINDOW_STATE_DESTROYED;
+  dsp->epoch++;
   XDestroyWindow (dsp->dsp, win->win);
 
+  /* The server may hand out the window's XID again. */
+  remove_event_handlers (dsp, win->win);
+
   return SCM_UNSPECIFIED;
 }
 #undef FUNC_NAME
@@ -1221,6 +1877,8 @@ SCM_DEFINE (scm_x_create_pixmap_x, "x-create-pixmap!", 5, 0, 0,
 
   pix->state = XWINDOW_STATE_PIXMAP;
   pix->dsp = display1;
+  pix->root = RootWindow (dsp->dsp, scr);
+  pix->depth = depth1;
   pix->win = XCreatePixmap (dsp->dsp,
 			    RootWindow (dsp->dsp, scr),
 			    width1,
@@ -1242,6 +1900,27 @@ SCM_DEFINE (scm_x_create_pixmap_x, "x-create-pixmap!", 5, 0, 0,
 }
 #undef FUNC_NAME
 
+SCM_DEFINE (scm_x_free_pixmap_x, "x-free-pixmap!", 1, 0, 0,
+            (SCM pixmap),
+            "Free @var{pixmap}.  A GC that uses it as its tile, stipple\n"
+            "or clip mask goes on doing so, as the server keeps the\n"
+            "pixmap until no GC refers to it.")
+#define FUNC_NAME s_scm_x_free_pixmap_x
+{
+  xdisplay_t *dsp;
+  xwindow_t *pix;
+
+  dsp = XDISPLAY (valid_dsp (pixmap, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
+  pix = valid_win (pixmap, SCM_ARG1, XWINDOW_STATE_PIXMAP, FUNC_NAME);
+
+  pix->state = XWINDOW_STATE_DESTROYED;
+  dsp->epoch++;
+  XFreePixmap (dsp->dsp, pix->win);
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
 SCM_DEFINE (scm_x_copy_area_x, "x-copy-area!", 9, 0, 0,
             (SCM source,
 	     SCM destination,
@@ -1249,7 +1928,10 @@ SCM_DEFINE (scm_x_copy_area_x, "x-copy-area!", 9, 0, 0,
 	     SCM src_x, SCM src_y,
 	     SCM width, SCM height,
 	     SCM dst_x, SCM dst_y),
-            "Copy specified area from one drawable to another.")
+            "Copy specified area from one drawable to another.\n"
+            "If @var{destination} is a display list, the copy is\n"
+            "recorded, and made to the drawable that the display list\n"
+            "is replayed on.")
 #define FUNC_NAME s_scm_x_copy_area_x
 {
   xwindow_t *src;
@@ -1262,13 +1944,27 @@ SCM_DEFINE (scm_x_copy_area_x, "x-copy-area!", 9, 0, 0,
   int dst_x1;
   int dst_y1;
 
+  if (SCM_NIMP (destination) && (SCM_TYP16 (destination) == scm_tc16_xdlist))
+    {
+      SCM_VALIDATE_INT_COPY (SCM_ARG4, src_x, src_x1);
+      SCM_VALIDATE_INT_COPY (SCM_ARG5, src_y, src_y1);
+      SCM_VALIDATE_UINT_COPY (SCM_ARG6, width, width1);
+      SCM_VALIDATE_UINT_COPY (SCM_ARG7, height, height1);
+      SCM_VALIDATE_INT_COPY (8, dst_x, dst_x1);
+      SCM_VALIDATE_INT_COPY (9, dst_y, dst_y1);
+
+      return record_copy_area (destination, source, gc,
+                               src_x1, src_y1, width1, height1, dst_x1, dst_y1,
+                               FUNC_NAME);
+    }
+
   src = valid_win (source, SCM_ARG1, (XWINDOW_STATE_MAPPED |
 				      XWINDOW_STATE_PIXMAP |
 				      XWINDOW_STATE_THIRD_PARTY), FUNC_NAME);
   dst = valid_win (destination, SCM_ARG2, (XWINDOW_STATE_MAPPED |
 					   XWINDOW_STATE_PIXMAP |
 					   XWINDOW_STATE_THIRD_PARTY), FUNC_NAME);
-  gc1 = valid_gc (gc, SCM_ARG3, (XGC_STATE_CREATED | XGC_STATE_DEFAULT), FUNC_NAME);
+  gc1 = valid_gc (gc, SCM_ARG3, (XGC_STATE_CREATED | XGC_STATE_DEFAULT | XGC_STATE_POOLED), FUNC_NAME);
   SCM_VALIDATE_INT_COPY (SCM_ARG4, src_x, src_x1);
   SCM_VALIDATE_INT_COPY (SCM_ARG5, src_y, src_y1);
   SCM_VALIDATE_UINT_COPY (SCM_ARG6, width, width1);
@@ -1286,6 +1982,126 @@ SCM_DEFINE (scm_x_copy_area_x, "x-copy-area!", 9, 0, 0,
 #undef FUNC_NAME
 
 
+/* FONTS */
+
+/* Smob print hook for fonts. */
+int xfont_print (SCM font, SCM port, scm_print_state *pstate)
+{
+  scm_puts ("#<x-font ", port);
+  scm_intprint (SCM_UNPACK (SCM_CDR (font)), 16, port);
+  scm_putc (' ', port);
+  switch (((xfont_t *) SCM_SMOB_DATA (font))->state)
+    {
+    case XFONT_STATE_LOADED:
+      scm_puts ("loaded", port);
+      break;
+    case XFONT_STATE_UNLOADED:
+      scm_puts ("unloaded", port);
+      break;
+    default:
+      scm_puts ("corrupt", port);
+      break;
+    }
+  scm_putc ('>', port);
+  return 1;
+}
+
+/* Smob free hook for fonts: unload the font first. */
+size_t xfont_free (SCM font)
+{
+  xfont_t *fnt = (xfont_t *) SCM_SMOB_DATA (font);
+
+  /* Only unload this font if the display is still valid. */
+  if ((SCM_TYP16 (fnt->dsp) == scm_tc16_xdisplay) &&
+      (XDISPLAY (fnt->dsp)->state == XDISPLAY_STATE_OPEN) &&
+      (fnt->state == XFONT_STATE_LOADED))
+    scm_x_unload_font_x (font);
+
+  return 0;
+}
+
+/* Smob mark hook for fonts: need to mark the display as well. */
+SCM xfont_mark (SCM font)
+{
+  xfont_t *fnt = (xfont_t *) SCM_SMOB_DATA (font);
+
+  return fnt->dsp;
+}
+
+static xfont_t * valid_font (SCM arg, int pos, int expected, const char *func)
+{
+  xfont_t *fnt;
+
+  SCM_ASSERT (SCM_NIMP (arg) && (SCM_TYP16 (arg) == scm_tc16_xfont), arg, pos, func);
+  fnt = (xfont_t *) SCM_SMOB_DATA (arg);
+
+  if ((fnt->state & expected) == 0)
+    scm_misc_error (func, "Font ~S has been unloaded", scm_list_1 (arg));
+
+  return fnt;
+}
+
+SCM_DEFINE (scm_x_load_font_x, "x-load-font!", 2, 0, 0,
+            (SCM display,
+             SCM name),
+            "Load the font called @var{name} on @var{display}, and\n"
+            "return it.  The font can be given as the value of the\n"
+            "@code{GCFont} field of a GC.")
+#define FUNC_NAME s_scm_x_load_font_x
+{
+  SCM display1;
+  xdisplay_t *dsp;
+  xfont_t *fnt;
+  XFontStruct *info;
+  char *name1;
+
+  display1 = valid_dsp (display, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME);
+  dsp = XDISPLAY (display1);
+  SCM_ASSERT (scm_is_string (name), name, SCM_ARG2, FUNC_NAME);
+
+  name1 = scm_to_locale_string (name);
+
+  /* XLoadFont reports a missing font only as an asynchronous error,
+     so look it up first. */
+  info = XLoadQueryFont (dsp->dsp, name1);
+  free (name1);
+
+  if (info == NULL)
+    scm_misc_error (FUNC_NAME, "Failed to load X font ~S", scm_list_1 (name));
+
+  fnt = scm_gc_malloc (sizeof (xfont_t), FUNC_NAME);
+
+  fnt->dsp = display1;
+  fnt->font = info->fid;
+  fnt->state = XFONT_STATE_LOADED;
+
+  /* Keep the font, but not the metrics. */
+  XFreeFontInfo (NULL, info, 1);
+
+  SCM_RETURN_NEWSMOB (scm_tc16_xfont, fnt);
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_unload_font_x, "x-unload-font!", 1, 0, 0,
+            (SCM font),
+            "Unload @var{font}.  A GC that uses it goes on doing so, as\n"
+            "the server keeps the font until no GC refers to it.")
+#define FUNC_NAME s_scm_x_unload_font_x
+{
+  xdisplay_t *dsp;
+  xfont_t *fnt;
+
+  dsp = XDISPLAY (valid_dsp (font, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
+  fnt = valid_font (font, SCM_ARG1, XFONT_STATE_LOADED, FUNC_NAME);
+
+  fnt->state = XFONT_STATE_UNLOADED;
+  XUnloadFont (dsp->dsp, fnt->font);
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+
 /* GCS */
 
 /* Smob print hook for gcs. */
@@ -1305,6 +2121,9 @@ int xgc_print (SCM gc, SCM port, scm_print_state *pstate)
     case XGC_STATE_FREED:
       scm_puts ("freed", port);
       break;
+    case XGC_STATE_POOLED:
+      scm_puts ("pooled", port);
+      break;
     default:
       scm_puts ("corrupt", port);
       break;
@@ -1330,7 +2149,11 @@ size_t xgc_free (SCM gc)
 SCM xgc_mark (SCM gc)
 {
   xgc_t *gc1 = (xgc_t *) SCM_SMOB_DATA (gc);
+  int i;
 
+  scm_gc_mark (gc1->transform);
+  for (i = 0; i < XGC_NUM_OBJS; i++)
+    scm_gc_mark (gc1->objs[i]);
   return gc1->dsp;
 }
 
@@ -1362,6 +2185,9 @@ static xgc_t * valid_gc (SCM arg, int pos, int expected, const char *func)
         case XGC_STATE_FREED:
           scm_misc_error (func, "GC ~S has been freed", scm_list_1 (arg));
 
+        case XGC_STATE_POOLED:
+          scm_misc_error (func, "GC ~S is a pooled GC", scm_list_1 (arg));
+
         default:
           scm_misc_error (func,
                           "Corrupt GC state (~S)",
@@ -1386,7 +2212,7 @@ SCM_DEFINE (scm_x_default_gc, "x-default-gc", 1, 1, 0,
   dsp = XDISPLAY (display1);
   scr = valid_scr (display, screen, SCM_ARG2, dsp, FUNC_NAME);
 
-  if (dsp->gc == SCM_BOOL_F)
+  if (scm_is_false (dsp->gcs[scr]))
     {
       /* Create and cache default GC smob. */
       xgc_t *gc1 = scm_gc_malloc (sizeof (xgc_t), FUNC_NAME);
@@ -1394,11 +2220,13 @@ SCM_DEFINE (scm_x_default_gc, "x-default-gc", 1, 1, 0,
       gc1->gc = DefaultGC (dsp->dsp, scr);
       gc1->dsp = display1;
       gc1->state = XGC_STATE_DEFAULT;
+      gc1->transform = SCM_BOOL_F;
+      prime_gc_shadow (dsp, gc1);
 
-      SCM_NEWSMOB (dsp->gc, scm_tc16_xgc, gc1);
+      SCM_NEWSMOB (dsp->gcs[scr], scm_tc16_xgc, gc1);
     }
 
-  return dsp->gc;
+  return dsp->gcs[scr];
 }
 #undef FUNC_NAME
 
@@ -1415,6 +2243,7 @@ SCM_DEFINE (scm_x_free_gc_x, "x-free-gc!", 1, 0, 0,
 
   XFreeGC (dsp->dsp, gc1->gc);
   gc1->state = XGC_STATE_FREED;
+  dsp->epoch++;
 
   return SCM_UNSPECIFIED;
 }
@@ -1425,80 +2254,198 @@ typedef struct xgc_field_t
   /* Function to handle setting a field of an XGCValues struct. */
   void (*handler) (XGCValues *gcv, int offset, SCM value);
 
-  /* Offset of field position within XGCValues. */
+  /* Offset and size of the field within XGCValues. */
   int offset;
+  int size;
+
+  /* For fields given by a pixmap or font smob, the index of the smob
+     in an xgc_t's OBJS, otherwise -1. */
+  int obj;
 
 } xgc_field_t;
 
 void gc_set_numeric_field (XGCValues *gcv, int offset, SCM value);
+void gc_set_ulong_field (XGCValues *gcv, int offset, SCM value);
 void gc_set_pixmap_field (XGCValues *gcv, int offset, SCM value);
 void gc_set_font_field (XGCValues *gcv, int offset, SCM value);
 void gc_set_boolean_field (XGCValues *gcv, int offset, SCM value);
 void gc_set_char_field (XGCValues *gcv, int offset, SCM value);
 
+#define GC_FIELD(handler, field, obj)                   \
+  { handler,                                            \
+    offsetof (XGCValues, field),                        \
+    sizeof (((XGCValues *) 0)->field),                  \
+    obj }
+
+/* GC fields, indexed by their bit number in a GC value mask (GCFunction
+   is bit 0, GCArcMode bit 22). */
 xgc_field_t gc_fields[23] = {
-  { gc_set_numeric_field, offsetof (XGCValues, function)           },
-  { gc_set_numeric_field, offsetof (XGCValues, plane_mask)         },
-  { gc_set_numeric_field, offsetof (XGCValues, foreground)         },
-  { gc_set_numeric_field, offsetof (XGCValues, background)         },
-  { gc_set_numeric_field, offsetof (XGCValues, line_width)         },
-  { gc_set_numeric_field, offsetof (XGCValues, line_style)         },
-  { gc_set_numeric_field, offsetof (XGCValues, cap_style)          },
-  { gc_set_numeric_field, offsetof (XGCValues, join_style)         },
-  { gc_set_numeric_field, offsetof (XGCValues, fill_style)         },
-  { gc_set_numeric_field, offsetof (XGCValues, fill_rule)          },
-  { gc_set_numeric_field, offsetof (XGCValues, arc_mode)           },
-  { gc_set_pixmap_field,  offsetof (XGCValues, tile)               },
-  { gc_set_pixmap_field,  offsetof (XGCValues, stipple)            },
-  { gc_set_numeric_field, offsetof (XGCValues, ts_x_origin)        },
-  { gc_set_numeric_field, offsetof (XGCValues, ts_y_origin)        },
-  { gc_set_font_field,    offsetof (XGCValues, font)               },
-  { gc_set_numeric_field, offsetof (XGCValues, subwindow_mode)     },
-  { gc_set_boolean_field, offsetof (XGCValues, graphics_exposures) },
-  { gc_set_numeric_field, offsetof (XGCValues, clip_x_origin)      },
-  { gc_set_numeric_field, offsetof (XGCValues, clip_y_origin)      },
-  { gc_set_pixmap_field,  offsetof (XGCValues, clip_mask)          },
-  { gc_set_numeric_field, offsetof (XGCValues, dash_offset)        },
-  { gc_set_char_field,    offsetof (XGCValues, dashes)             }
+  GC_FIELD (gc_set_numeric_field,  function,            -1),
+  GC_FIELD (gc_set_ulong_field,    plane_mask,          -1),
+  GC_FIELD (gc_set_ulong_field,    foreground,          -1),
+  GC_FIELD (gc_set_ulong_field,    background,          -1),
+  GC_FIELD (gc_set_numeric_field,  line_width,          -1),
+  GC_FIELD (gc_set_numeric_field,  line_style,          -1),
+  GC_FIELD (gc_set_numeric_field,  cap_style,           -1),
+  GC_FIELD (gc_set_numeric_field,  join_style,          -1),
+  GC_FIELD (gc_set_numeric_field,  fill_style,          -1),
+  GC_FIELD (gc_set_numeric_field,  fill_rule,           -1),
+  GC_FIELD (gc_set_pixmap_field,   tile,                XGC_OBJ_TILE),
+  GC_FIELD (gc_set_pixmap_field,   stipple,             XGC_OBJ_STIPPLE),
+  GC_FIELD (gc_set_numeric_field,  ts_x_origin,         -1),
+  GC_FIELD (gc_set_numeric_field,  ts_y_origin,         -1),
+  GC_FIELD (gc_set_font_field,     font,                XGC_OBJ_FONT),
+  GC_FIELD (gc_set_numeric_field,  subwindow_mode,      -1),
+  GC_FIELD (gc_set_boolean_field,  graphics_exposures,  -1),
+  GC_FIELD (gc_set_numeric_field,  clip_x_origin,       -1),
+  GC_FIELD (gc_set_numeric_field,  clip_y_origin,       -1),
+  GC_FIELD (gc_set_pixmap_field,   clip_mask,           XGC_OBJ_CLIP_MASK),
+  GC_FIELD (gc_set_numeric_field,  dash_offset,         -1),
+  GC_FIELD (gc_set_char_field,     dashes,              -1),
+  GC_FIELD (gc_set_numeric_field,  arc_mode,            -1)
 };
 
-SCM_DEFINE (scm_x_create_gc_x, "x-create-gc!", 1, 0, 1,
-            (SCM drawable,
-             SCM changes),
-            "Creates the specified @var{gc}.")
-#define FUNC_NAME s_scm_x_create_gc_x
-{
-  SCM display1;
-  xdisplay_t *dsp;
-  xwindow_t *win;
-  unsigned long mask = 0;
-  XGCValues gcv;
-  xgc_t *gc1;
+#undef GC_FIELD
 
-  display1 = valid_dsp (drawable, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME);
-  dsp = XDISPLAY (display1);
-  win = valid_win (drawable, SCM_ARG1, ~XWINDOW_STATE_DESTROYED, FUNC_NAME);
+/* The fields that XGetGCValues can tell us.  It can't return the
+   clip mask or dash list, and the IDs it returns for the tile,
+   stipple and font are not reliable. */
+#define GC_SHADOW_FIELDS (((1L << 23) - 1) &            \
+                          ~(GCClipMask | GCDashList |   \
+                            GCTile | GCStipple | GCFont))
 
-  SCM_ASSERT ((scm_ilength (changes) & 1) == 0, changes, SCM_ARGn, FUNC_NAME);
+/* Initialize the shadow values of GC1 from Xlib's own record of
+   them.  This does not involve the server. */
+static void prime_gc_shadow (xdisplay_t *dsp, xgc_t *gc1)
+{
+  int i;
 
-  for (; !SCM_NULLP (changes); changes = SCM_CDDR (changes))
-    {
-      SCM field = SCM_CAR (changes);
-      int fld;
+  memset (&gc1->values, 0, sizeof (XGCValues));
+  for (i = 0; i < XGC_NUM_OBJS; i++)
+    gc1->objs[i] = SCM_BOOL_F;
 
-      SCM_ASSERT (scm_integer_p (field), field, SCM_ARGn, FUNC_NAME);
+  if (XGetGCValues (dsp->dsp, gc1->gc, GC_SHADOW_FIELDS, &gc1->values))
+    gc1->known = GC_SHADOW_FIELDS;
+  else
+    gc1->known = 0;
+}
+
+/* Record in GC1's shadow that the fields in MASK have the values in
+   GCV, given by the smobs in OBJS for pixmap and font fields. */
+static void note_gc_values (xgc_t *gc1, unsigned long mask, XGCValues *gcv, SCM *objs)
+{
+  int fld;
+
+  for (fld = 0; fld < 23; fld++)
+    if (mask & (1L << fld))
+      {
+        memcpy (((char *) &gc1->values) + gc_fields[fld].offset,
+                ((char *) gcv) + gc_fields[fld].offset,
+                gc_fields[fld].size);
+        if (gc_fields[fld].obj >= 0)
+          gc1->objs[gc_fields[fld].obj] = objs[gc_fields[fld].obj];
+      }
+
+  gc1->known |= mask;
+}
+
+/* Return the smob to keep for field FLD, given VALUE.  A clip mask of
+   None, however it was given, is kept as #f, so that only pixmap and
+   font smobs are ever kept and equal values compare equal. */
+static SCM gc_field_obj (int fld, SCM value)
+{
+  if (((1L << fld) == GCClipMask) && !SCM_NIMP (value))
+    return SCM_BOOL_F;
+  return value;
+}
+
+/* Fill in GCV from CHANGES, a list of alternating GC field numbers
+   and values, and OBJS with the smobs given for pixmap and font
+   fields.  Return the corresponding value mask. */
+static unsigned long parse_gc_changes (SCM changes, XGCValues *gcv, SCM *objs, const char *func)
+#define FUNC_NAME func
+{
+  unsigned long mask = 0;
+
+  SCM_ASSERT ((scm_ilength (changes) & 1) == 0, changes, SCM_ARGn, FUNC_NAME);
+
+  for (; !SCM_NULLP (changes); changes = SCM_CDDR (changes))
+    {
+      SCM field = SCM_CAR (changes);
+      int fld;
+
+      SCM_ASSERT (scm_is_integer (field), field, SCM_ARGn, FUNC_NAME);
       fld = scm_to_int (field);
       SCM_ASSERT_RANGE (SCM_ARG2, field, (fld >= 0) && (fld <= 22));
 
       mask = mask | (1L << fld);
-      (*gc_fields[fld].handler) (&gcv, gc_fields[fld].offset, SCM_CADR (changes));
+      (*gc_fields[fld].handler) (gcv, gc_fields[fld].offset, SCM_CADR (changes));
+      if (gc_fields[fld].obj >= 0)
+        objs[gc_fields[fld].obj] = gc_field_obj (fld, SCM_CADR (changes));
+    }
+
+  return mask;
+}
+#undef FUNC_NAME
+
+/* Apply the changes in MASK, GCV and OBJS to GC1.  Fields that already
+   have the values given, according to GC1's shadow values, are left
+   alone; if no field changes, nothing is sent. */
+static void change_gc (xdisplay_t *dsp, xgc_t *gc1, unsigned long mask, XGCValues *gcv, SCM *objs)
+{
+  unsigned long changed = 0;
+  int fld;
+
+  for (fld = 0; fld < 23; fld++)
+    if (mask & (1L << fld))
+      {
+        int obj = gc_fields[fld].obj;
+
+        if ((gc1->known & (1L << fld)) &&
+            (memcmp (((char *) &gc1->values) + gc_fields[fld].offset,
+                     ((char *) gcv) + gc_fields[fld].offset,
+                     gc_fields[fld].size) == 0) &&
+            ((obj < 0) || scm_is_eq (gc1->objs[obj], objs[obj])))
+          continue;
+
+        changed |= (1L << fld);
+      }
+
+  if (changed)
+    {
+      XChangeGC (dsp->dsp, gc1->gc, changed, gcv);
+      note_gc_values (gc1, changed, gcv, objs);
     }
+}
+
+SCM_DEFINE (scm_x_create_gc_x, "x-create-gc!", 1, 0, 1,
+            (SCM drawable,
+             SCM changes),
+            "Creates the specified @var{gc}.")
+#define FUNC_NAME s_scm_x_create_gc_x
+{
+  SCM display1;
+  xdisplay_t *dsp;
+  xwindow_t *win;
+  unsigned long mask = 0;
+  XGCValues gcv;
+  SCM objs[XGC_NUM_OBJS];
+  xgc_t *gc1;
+
+  display1 = valid_dsp (drawable, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME);
+  dsp = XDISPLAY (display1);
+  win = valid_win (drawable, SCM_ARG1, ~XWINDOW_STATE_DESTROYED, FUNC_NAME);
+
+  mask = parse_gc_changes (changes, &gcv, objs, FUNC_NAME);
 
   gc1 = scm_gc_malloc (sizeof (xgc_t), FUNC_NAME);
 
   gc1->gc = XCreateGC (dsp->dsp, win->win, mask, &gcv);
   gc1->dsp = display1;
   gc1->state = XGC_STATE_CREATED;
+  gc1->transform = SCM_BOOL_F;
+  prime_gc_shadow (dsp, gc1);
+  note_gc_values (gc1, mask, &gcv, objs);
 
   SCM_RETURN_NEWSMOB (scm_tc16_xgc, gc1);
 }
@@ -1514,26 +2461,13 @@ SCM_DEFINE (scm_x_change_gc_x, "x-change-gc!", 1, 0, 1,
   xgc_t *gc1;
   unsigned long mask = 0;
   XGCValues gcv;
+  SCM objs[XGC_NUM_OBJS];
 
   dsp = XDISPLAY (valid_dsp (gc, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
   gc1 = valid_gc (gc, SCM_ARG1, (XGC_STATE_CREATED | XGC_STATE_DEFAULT), FUNC_NAME);
 
-  SCM_ASSERT ((scm_ilength (changes) & 1) == 0, changes, SCM_ARGn, FUNC_NAME);
-
-  for (; !SCM_NULLP (changes); changes = SCM_CDDR (changes))
-    {
-      SCM field = SCM_CAR (changes);
-      int fld;
-
-      SCM_ASSERT (scm_integer_p (field), field, SCM_ARGn, FUNC_NAME);
-      fld = scm_to_int (field);
-      SCM_ASSERT_RANGE (SCM_ARG2, field, (fld >= 0) && (fld <= 22));
-
-      mask = mask | (1L << fld);
-      (*gc_fields[fld].handler) (&gcv, gc_fields[fld].offset, SCM_CADR (changes));
-    }
-
-  XChangeGC (dsp->dsp, gc1->gc, mask, &gcv);
+  mask = parse_gc_changes (changes, &gcv, objs, FUNC_NAME);
+  change_gc (dsp, gc1, mask, &gcv, objs);
 
   return SCM_UNSPECIFIED;
 }
@@ -1542,18 +2476,32 @@ SCM_DEFINE (scm_x_change_gc_x, "x-change-gc!", 1, 0, 1,
 #define FUNC_NAME s_scm_x_change_gc_x
 void gc_set_numeric_field (XGCValues *gcv, int offset, SCM value)
 {
-  SCM_ASSERT (SCM_NUMBERP (value), value, SCM_ARGn, FUNC_NAME);
-  *((int *) (((char *) gcv) + offset)) = SCM_NUM2ULONG (SCM_ARGn, value);
+  SCM_ASSERT (scm_is_integer (value), value, SCM_ARGn, FUNC_NAME);
+  *((int *) (((char *) gcv) + offset)) = scm_to_int (value);
+}
+
+void gc_set_ulong_field (XGCValues *gcv, int offset, SCM value)
+{
+  SCM_ASSERT (scm_is_integer (value), value, SCM_ARGn, FUNC_NAME);
+  *((unsigned long *) (((char *) gcv) + offset)) = scm_to_ulong (value);
 }
 
 void gc_set_pixmap_field (XGCValues *gcv, int offset, SCM value)
 {
-  SCM_ASSERT (0, value, SCM_ARGn, FUNC_NAME);
+  Pixmap *field = (Pixmap *) (((char *) gcv) + offset);
+
+  /* Only the clip mask can be None, given as None or #f. */
+  if ((offset == offsetof (XGCValues, clip_mask)) &&
+      (scm_is_false (value) || scm_is_eq (value, SCM_INUM0)))
+    *field = None;
+  else
+    *field = valid_win (value, SCM_ARGn, XWINDOW_STATE_PIXMAP, FUNC_NAME)->win;
 }
 
 void gc_set_font_field (XGCValues *gcv, int offset, SCM value)
 {
-  SCM_ASSERT (0, value, SCM_ARGn, FUNC_NAME);
+  *((Font *) (((char *) gcv) + offset)) =
+    valid_font (value, SCM_ARGn, XFONT_STATE_LOADED, FUNC_NAME)->font;
 }
 
 void gc_set_boolean_field (XGCValues *gcv, int offset, SCM value)
@@ -1564,46 +2512,206 @@ void gc_set_boolean_field (XGCValues *gcv, int offset, SCM value)
 
 void gc_set_char_field (XGCValues *gcv, int offset, SCM value)
 {
-  SCM_ASSERT (scm_integer_p (value), value, SCM_ARGn, FUNC_NAME);
+  SCM_ASSERT (scm_is_integer (value), value, SCM_ARGn, FUNC_NAME);
   *(((char *) gcv) + offset) = (char) scm_to_int (value);
 }
 #undef FUNC_NAME
 
+/* A GC spec is a list of fields that has been checked in advance, so
+   that x-apply-gc-spec! only has to convert the values. */
+
+int xgcspec_print (SCM spec, SCM port, scm_print_state *pstate)
+{
+  xgcspec_t *sp = XGCSPEC (spec);
+  int i;
+
+  scm_puts ("#<x-gc-spec ", port);
+  scm_intprint (SCM_UNPACK (SCM_CDR (spec)), 16, port);
+  for (i = 0; i < sp->count; i++)
+    {
+      scm_putc (' ', port);
+      scm_intprint (sp->fields[i], 10, port);
+    }
+  scm_putc ('>', port);
+  return 1;
+}
+
+static xgcspec_t * valid_gcspec (SCM arg, int pos, const char *func)
+{
+  SCM_ASSERT (SCM_NIMP (arg) && (SCM_TYP16 (arg) == scm_tc16_xgcspec), arg, pos, func);
+
+  return XGCSPEC (arg);
+}
+
+SCM_DEFINE (scm_x_make_gc_spec, "x-make-gc-spec", 0, 0, 1,
+            (SCM fields),
+            "Return a GC spec for the GC field numbers @var{fields},\n"
+            "which are those accepted by @code{x-change-gc!}.  Each field\n"
+            "may appear only once.  Values for the fields, in the same\n"
+            "order, are applied to a GC with @code{x-apply-gc-spec!}.")
+#define FUNC_NAME s_scm_x_make_gc_spec
+{
+  xgcspec_t *sp = scm_gc_malloc_pointerless (sizeof (xgcspec_t), FUNC_NAME);
+
+  sp->mask = 0;
+  sp->count = 0;
+
+  for (; !SCM_NULLP (fields); fields = SCM_CDR (fields))
+    {
+      SCM field = SCM_CAR (fields);
+      int fld;
+
+      SCM_ASSERT (scm_is_integer (field), field, SCM_ARGn, FUNC_NAME);
+      fld = scm_to_int (field);
+      SCM_ASSERT_RANGE (SCM_ARGn, field, (fld >= 0) && (fld <= 22));
+      if (sp->mask & (1L << fld))
+        scm_misc_error (FUNC_NAME, "Field ~S given twice", scm_list_1 (field));
+
+      sp->mask |= (1L << fld);
+      sp->fields[sp->count++] = fld;
+    }
+
+  SCM_RETURN_NEWSMOB (scm_tc16_xgcspec, sp);
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_apply_gc_spec_x, "x-apply-gc-spec!", 3, 3, 0,
+            (SCM gc,
+             SCM spec,
+             SCM value1,
+             SCM value2,
+             SCM value3,
+             SCM value4),
+            "Change the fields of @var{gc} listed in @var{spec} to the\n"
+            "values given.  The values are either given as arguments,\n"
+            "for a spec of up to four fields, or as a single vector.\n"
+            "As with @code{x-change-gc!}, only fields whose values\n"
+            "differ from those @var{gc} already has are sent to the\n"
+            "server.")
+#define FUNC_NAME s_scm_x_apply_gc_spec_x
+{
+  xdisplay_t *dsp;
+  xgc_t *gc1;
+  xgcspec_t *sp;
+  XGCValues gcv;
+  SCM objs[XGC_NUM_OBJS];
+  SCM args[4];
+  int i;
+
+  dsp = XDISPLAY (valid_dsp (gc, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
+  gc1 = valid_gc (gc, SCM_ARG1, (XGC_STATE_CREATED | XGC_STATE_DEFAULT), FUNC_NAME);
+  sp = valid_gcspec (spec, SCM_ARG2, FUNC_NAME);
+
+  /* GC field values are never vectors, so a vector must hold the
+     values. */
+  if (scm_is_vector (value1) && SCM_UNBNDP (value2))
+    {
+      SCM_ASSERT_RANGE (SCM_ARG3, value1,
+                        scm_c_vector_length (value1) == (size_t) sp->count);
+
+      for (i = 0; i < sp->count; i++)
+        {
+          int fld = sp->fields[i];
+
+          args[0] = scm_c_vector_ref (value1, i);
+          (*gc_fields[fld].handler) (&gcv, gc_fields[fld].offset, args[0]);
+          if (gc_fields[fld].obj >= 0)
+            objs[gc_fields[fld].obj] = gc_field_obj (fld, args[0]);
+        }
+    }
+  else
+    {
+      args[0] = value1;
+      args[1] = value2;
+      args[2] = value3;
+      args[3] = value4;
+
+      for (i = 0; (i < 4) && !SCM_UNBNDP (args[i]); i++)
+        ;
+      if (i != sp->count)
+        scm_misc_error (FUNC_NAME,
+                        "Expected ~S values, got ~S",
+                        scm_list_2 (scm_from_int (sp->count), scm_from_int (i)));
+
+      for (i = 0; i < sp->count; i++)
+        {
+          int fld = sp->fields[i];
+
+          (*gc_fields[fld].handler) (&gcv, gc_fields[fld].offset, args[i]);
+          if (gc_fields[fld].obj >= 0)
+            objs[gc_fields[fld].obj] = gc_field_obj (fld, args[i]);
+        }
+    }
+
+  change_gc (dsp, gc1, sp->mask, &gcv, objs);
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
 SCM_DEFINE (scm_x_set_dashes_x, "x-set-dashes!", 3, 0, 0,
             (SCM gc,
              SCM offset,
              SCM dashes),
-            "See XSetDashes.")
+            "See XSetDashes.  @var{dashes} is a list of dash lengths,\n"
+            "or a bytevector holding them, each from 1 to 255.")
 #define FUNC_NAME s_scm_x_set_dashes_x
 {
   xdisplay_t *dsp;
   xgc_t *gc1;
+  int offset1;
   int n;
+  char stack[64];
   char *dash_list;
+  SCM l;
 
   dsp = XDISPLAY (valid_dsp (gc, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
   gc1 = valid_gc (gc, SCM_ARG1, (XGC_STATE_CREATED | XGC_STATE_DEFAULT), FUNC_NAME);
-  SCM_ASSERT (scm_integer_p (offset), offset, SCM_ARG2, FUNC_NAME);
-  SCM_VALIDATE_LIST_COPYLEN (SCM_ARG3, dashes, n);
-
-  /* Allocate a character array to pass dash list to Xlib. */
-  dash_list = (char *) scm_gc_malloc (n * sizeof (char), FUNC_NAME);
+  SCM_VALIDATE_INT_COPY (SCM_ARG2, offset, offset1);
 
-  /* Copy dash lengths into this array. */
-  for (n = 0; !SCM_NULLP (dashes); n++, dashes = SCM_CDR (dashes))
+  if (scm_is_bytevector (dashes))
+    {
+      /* Bytevectors are passed to Xlib as they are. */
+      n = SCM_BYTEVECTOR_LENGTH (dashes);
+      dash_list = (char *) SCM_BYTEVECTOR_CONTENTS (dashes);
+      SCM_ASSERT_RANGE (SCM_ARG3, dashes,
+                        (n > 0) && (memchr (dash_list, 0, n) == NULL));
+    }
+  else
     {
-      SCM len = SCM_CAR (dashes);
+      SCM_VALIDATE_LIST_COPYLEN (SCM_ARG3, dashes, n);
+      SCM_ASSERT_RANGE (SCM_ARG3, dashes, n > 0);
+
+      /* Check the lengths before taking any storage for them, so that
+         nothing needs freeing on error. */
+      for (l = dashes; !SCM_NULLP (l); l = SCM_CDR (l))
+        {
+          SCM len = SCM_CAR (l);
+
+          SCM_ASSERT (scm_is_integer (len), len, SCM_ARG3, FUNC_NAME);
+          SCM_ASSERT_RANGE (SCM_ARG3, len,
+                            (scm_to_int (len) >= 1) && (scm_to_int (len) <= 255));
+        }
 
-      if (!scm_integer_p (len))
-        scm_gc_free (dash_list, n * sizeof (char), FUNC_NAME);
+      /* Dash lists are short, so the stack almost always does;
+         longer ones go in the display's scratch arena. */
+      if (n <= (int) sizeof (stack))
+        dash_list = stack;
+      else
+        {
+          scratch_reset (dsp, FUNC_NAME);
+          dash_list = scratch_alloc (dsp, n, FUNC_NAME);
+        }
 
-      SCM_ASSERT (scm_integer_p (len), len, SCM_ARG3, FUNC_NAME);
-      dash_list[n] = scm_to_int (len);
+      for (n = 0, l = dashes; !SCM_NULLP (l); n++, l = SCM_CDR (l))
+        dash_list[n] = scm_to_int (SCM_CAR (l));
     }
 
-  XSetDashes (dsp->dsp, gc1->gc, scm_to_int (offset), dash_list, n);
+  XSetDashes (dsp->dsp, gc1->gc, offset1, dash_list, n);
 
-  scm_gc_free (dash_list, n * sizeof(char), FUNC_NAME);
+  /* A dash list cannot be shadowed: only its first element could. */
+  gc1->values.dash_offset = offset1;
+  gc1->known = (gc1->known | GCDashOffset) & ~GCDashList;
 
   return SCM_UNSPECIFIED;
 }
@@ -1615,24 +2723,24 @@ SCM_DEFINE (scm_x_set_clip_rectangles_x, "x-set-clip-rectangles!", 4, 1, 0,
              SCM y,
              SCM rectangles,
              SCM ordering),
-            "See XSetClipRectangles.")
+            "See XSetClipRectangles.  @var{rectangles} are as for\n"
+            "@code{x-draw-rectangles!}.")
 #define FUNC_NAME s_scm_x_set_clip_rectangles_x
 {
   xdisplay_t *dsp;
   xgc_t *gc1;
   int order;
-  int allocatedp;
-  int num_rectangles;
-  XRectangle *dat;
+  xdata_t xd;
+  XRectangle stack[64];
 
   dsp = XDISPLAY (valid_dsp (gc, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
   gc1 = valid_gc (gc, SCM_ARG1, (XGC_STATE_CREATED | XGC_STATE_DEFAULT), FUNC_NAME);
-  SCM_ASSERT (scm_integer_p (x), x, SCM_ARG2, FUNC_NAME);
-  SCM_ASSERT (scm_integer_p (y), y, SCM_ARG3, FUNC_NAME);
+  SCM_ASSERT (scm_is_integer (x), x, SCM_ARG2, FUNC_NAME);
+  SCM_ASSERT (scm_is_integer (y), y, SCM_ARG3, FUNC_NAME);
 
   if (!SCM_UNBNDP (ordering))
     {
-      SCM_ASSERT (scm_integer_p (ordering), ordering, SCM_ARG5, FUNC_NAME);
+      SCM_ASSERT (scm_is_integer (ordering), ordering, SCM_ARG5, FUNC_NAME);
       order = scm_to_int (ordering);
       SCM_ASSERT_RANGE (SCM_ARG5,
                         ordering,
@@ -1641,23 +2749,28 @@ SCM_DEFINE (scm_x_set_clip_rectangles_x, "x-set-clip-rectangles!", 4, 1, 0,
   else
     order = Unsorted;
 
-  dat = (XRectangle *) valid_data (rectangles,
-                                   SCM_ARG4,
-                                   XDATA_RECTANGLES,
-                                   &allocatedp,
-                                   &num_rectangles,
-                                   FUNC_NAME);
+  /* Packed s16 arrays and bytevectors are used in place, and other
+     arrays of up to 64 rectangles are converted on the stack. */
+  scratch_reset (dsp, FUNC_NAME);
+  valid_data_scratch (rectangles, SCM_ARG4, XDATA_RECTANGLES, NULL, 0,
+                      stack, sizeof (stack), dsp, &xd, FUNC_NAME);
 
   XSetClipRectangles (dsp->dsp,
                       gc1->gc,
                       scm_to_int (x),
                       scm_to_int (y),
-                      dat,
-                      num_rectangles,
+                      (XRectangle *) xd.data,
+                      xd.count,
                       order);
 
-  if (allocatedp)
-    scm_gc_free (dat, sizeof(XRectangle), FUNC_NAME);
+  /* The clip mask is now a list of rectangles, which no value of the
+     clip_mask field stands for. */
+  gc1->values.clip_x_origin = scm_to_int (x);
+  gc1->values.clip_y_origin = scm_to_int (y);
+  gc1->known = (gc1->known | GCClipXOrigin | GCClipYOrigin) & ~GCClipMask;
+  gc1->objs[XGC_OBJ_CLIP_MASK] = SCM_BOOL_F;
+
+  release_data (&xd, FUNC_NAME);
 
   return SCM_UNSPECIFIED;
 }
@@ -1672,19 +2785,19 @@ SCM_DEFINE (scm_x_copy_gc_x, "x-copy-gc!", 2, 0, 1,
   xdisplay_t *dsp;
   xgc_t *gc1, *gc2;
   unsigned long mask = 0;
+  int fld;
 
   dsp = XDISPLAY (valid_dsp (src, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
   gc1 = valid_gc (src, SCM_ARG1, (XGC_STATE_CREATED | XGC_STATE_DEFAULT), FUNC_NAME);
-  gc2 = valid_gc (dst, SCM_ARG2, ~XGC_STATE_FREED, FUNC_NAME);
+  gc2 = valid_gc (dst, SCM_ARG2, (XGC_STATE_CREATED | XGC_STATE_DEFAULT), FUNC_NAME);
 
   SCM_VALIDATE_LIST (SCM_ARG3, fields);
 
-  for (; !SCM_NULLP (fields); fields = SCM_CDDR (fields))
+  for (; !SCM_NULLP (fields); fields = SCM_CDR (fields))
     {
       SCM field = SCM_CAR (fields);
-      int fld;
 
-      SCM_ASSERT (scm_integer_p (field), field, SCM_ARGn, FUNC_NAME);
+      SCM_ASSERT (scm_is_integer (field), field, SCM_ARGn, FUNC_NAME);
       fld = scm_to_int (field);
       SCM_ASSERT_RANGE (SCM_ARG3, field, (fld >= 0) && (fld <= 22));
 
@@ -1693,315 +2806,3565 @@ SCM_DEFINE (scm_x_copy_gc_x, "x-copy-gc!", 2, 0, 1,
 
   XCopyGC (dsp->dsp, gc1->gc, mask, gc2->gc);
 
+  /* The copied fields of the destination are now known if they were
+     known in the source. */
+  note_gc_values (gc2, mask, &gc1->values, gc1->objs);
+  gc2->known = (gc2->known & ~mask) | (gc1->known & mask);
+
   return SCM_UNSPECIFIED;
 }
 #undef FUNC_NAME
 
 
-/* VISUALS */
+/* Return the value of field FLD of GC1, as x-change-gc! would take it,
+   or #f if it is not known. */
+static SCM gc_field_value (xdisplay_t *dsp, xgc_t *gc1, int fld)
+{
+  unsigned long bit = 1L << fld;
+  void (*handler) (XGCValues *gcv, int offset, SCM value) = gc_fields[fld].handler;
+  char *field = ((char *) &gc1->values) + gc_fields[fld].offset;
 
-/* DefaultVisual */
+  /* Xlib keeps its own copy of all but the clip mask, dash list and
+     resource fields, so reading them from it needs no round trip. */
+  if (!(gc1->known & bit) && (GC_SHADOW_FIELDS & bit))
+    {
+      unsigned long need = GC_SHADOW_FIELDS & ~gc1->known;
 
+      if (XGetGCValues (dsp->dsp, gc1->gc, need, &gc1->values))
+        gc1->known |= need;
+    }
 
-/* COLORMAPS */
+  if (!(gc1->known & bit))
+    return SCM_BOOL_F;
 
-/* DefaultColormap */
+  if (gc_fields[fld].obj >= 0)
+    return gc1->objs[gc_fields[fld].obj];
+  if (handler == gc_set_ulong_field)
+    return scm_from_ulong (*((unsigned long *) field));
+  if (handler == gc_set_boolean_field)
+    return scm_from_bool (*((Bool *) field));
+  if (handler == gc_set_char_field)
+    return scm_from_int (*((unsigned char *) field));
 
+  return scm_from_int (*((int *) field));
+}
 
-/* DRAWING (NON-TEXT) */
+SCM_DEFINE (scm_x_get_gc_values, "x-get-gc-values", 1, 2, 0,
+            (SCM gc,
+             SCM spec,
+             SCM vector),
+            "Return the values of the fields of @var{gc}, as a vector\n"
+            "indexed by GC field number.  If the GC spec @var{spec} is\n"
+            "given, return just the values of its fields, in its order,\n"
+            "filling in and returning @var{vector} if that is given too.\n"
+            "Values are those that @code{x-change-gc!} takes, or #f for\n"
+            "fields whose values are not known: the dash list after\n"
+            "@code{x-set-dashes!}, the clip mask after\n"
+            "@code{x-set-clip-rectangles!}, and the tile, stipple and\n"
+            "font if they have not been set.  No values are fetched\n"
+            "from the server.")
+#define FUNC_NAME s_scm_x_get_gc_values
+{
+  xdisplay_t *dsp;
+  xgc_t *gc1;
+  xgcspec_t *sp;
+  int i;
 
-static shorts_per_datum[5] = { 6, 2, 2, 4, 4 };
+  dsp = XDISPLAY (valid_dsp (gc, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
+  gc1 = valid_gc (gc, SCM_ARG1, ~XGC_STATE_FREED, FUNC_NAME);
 
-#define XDATACONV_UNKNOWN     0
-#define XDATACONV_REQUIRED    1
-#define XDATACONV_UNNECESSARY 2
+  if (SCM_UNBNDP (spec))
+    {
+      vector = scm_c_make_vector (23, SCM_BOOL_F);
+      for (i = 0; i < 23; i++)
+        SCM_SIMPLE_VECTOR_SET (vector, i, gc_field_value (dsp, gc1, i));
+      return vector;
+    }
 
-static data_conversion[5] = {
-  XDATACONV_UNKNOWN,
-  XDATACONV_UNKNOWN,
-  XDATACONV_UNKNOWN,
-  XDATACONV_UNKNOWN,
-  XDATACONV_UNKNOWN
-};
+  sp = valid_gcspec (spec, SCM_ARG2, FUNC_NAME);
 
-static datum_size[5] = {
-  sizeof (XArc),
-  sizeof (XPoint),
-  sizeof (XSegment),
-  sizeof (XRectangle)
-};
+  if (SCM_UNBNDP (vector))
+    vector = scm_c_make_vector (sp->count, SCM_BOOL_F);
+  else
+    {
+      SCM_ASSERT (scm_is_simple_vector (vector), vector, SCM_ARG3, FUNC_NAME);
+      SCM_ASSERT_RANGE (SCM_ARG3, vector,
+                        SCM_SIMPLE_VECTOR_LENGTH (vector) >= (size_t) sp->count);
+    }
 
-static void * valid_data (SCM arg,
-                          int pos,
-                          int type,
-                          int *allocatedp,
-                          int *count,
-                          const char *func)
-{
-  scm_t_array_dim *dims;
-  scm_t_array_handle handle;
-  int num_shorts_per_datum;
-  int num_data;
-  short *vdat;
-  void *data;
-  int i;
+  for (i = 0; i < sp->count; i++)
+    SCM_SIMPLE_VECTOR_SET (vector, i, gc_field_value (dsp, gc1, sp->fields[i]));
 
-  /* SCM_VALIDATE_ARRAY. */
-  SCM_ASSERT (SCM_NIMP (arg) && (SCM_BOOL_F != scm_array_p (arg, SCM_UNDEFINED)),
-              arg, pos, func);
+  return vector;
+}
+#undef FUNC_NAME
 
-  /* The underlying vector must be a uniform vector of shorts. */
-  SCM_ASSERT (scm_typed_array_p(arg, scm_from_utf8_symbol("s8")), arg, pos, func);
+/* A display's GC pool shares GCs between callers that ask for the
+   same values, so that the number of GCs on the server stays bounded
+   and rebuilding a set of styles does not create new ones.  Pooled
+   GCs are shared, so they can be drawn with but not changed. */
 
-  scm_array_get_handle(arg, &handle);
+/* Fill in the root and depth of WIN, if they are not yet known. */
+static void drawable_root_depth (xdisplay_t *dsp, xwindow_t *win)
+{
+  if (win->depth == 0)
+    {
+      Window root;
+      int x, y;
+      unsigned int width, height, border, depth;
+
+      XGetGeometry (dsp->dsp, win->win,
+                    &root, &x, &y, &width, &height, &border, &depth);
+      win->root = root;
+      win->depth = depth;
+    }
+}
 
-  /* Array must have two dimensions. */
-  SCM_ASSERT (scm_array_handle_rank (&handle) == 2, arg, pos, func);
+/* Return nonzero if A and B agree in the fields in MASK. */
+static int gc_values_equal (unsigned long mask, XGCValues *a, XGCValues *b)
+{
+  int fld;
 
-  /* Read dimensions. */
-  dims = scm_array_handle_dims (&handle);
-  num_data             = dims[0].ubnd - dims[0].lbnd + 1;
-  num_shorts_per_datum = dims[1].ubnd - dims[1].lbnd + 1;
-  if (num_shorts_per_datum != shorts_per_datum[type])
-    scm_misc_error (func,
-                    "Data has incorrect dimensions (~S, expected ~S)",
-                    scm_list_2 (scm_from_int (num_shorts_per_datum),
-                               scm_from_int (shorts_per_datum[type])));
+  for (fld = 0; fld < 23; fld++)
+    if ((mask & (1L << fld)) &&
+        (memcmp (((char *) a) + gc_fields[fld].offset,
+                 ((char *) b) + gc_fields[fld].offset,
+                 gc_fields[fld].size) != 0))
+      return 0;
 
-  vdat = (short *) scm_array_handle_uniform_elements(&handle);
+  return 1;
+}
 
-  /* Do we need to make a copy of the data? */
-  if (data_conversion[type] != XDATACONV_UNNECESSARY)
-    {
-      /* Yes. */
-      data = scm_gc_malloc (num_data * datum_size[type], func);
-      switch (type)
-        {
-        case XDATA_ARCS:
-          for (i = 0; i < num_data; i++)
-            {
-              ((XArc *) data)[i].x      = *vdat++;
-              ((XArc *) data)[i].y      = *vdat++;
-              ((XArc *) data)[i].width  = *vdat++;
-              ((XArc *) data)[i].height = *vdat++;
-              ((XArc *) data)[i].angle1 = *vdat++;
-              ((XArc *) data)[i].angle2 = *vdat++;
-            }
-          break;
+/* Return nonzero if A and B hold the same smobs for the pixmap and
+   font fields in MASK. */
+static int gc_objs_equal (unsigned long mask, SCM *a, SCM *b)
+{
+  int fld;
 
-        case XDATA_LINES:
-        case XDATA_POINTS:
-          for (i = 0; i < num_data; i++)
-            {
-              ((XPoint *) data)[i].x = *vdat++;
-              ((XPoint *) data)[i].y = *vdat++;
-            }
-          break;
+  for (fld = 0; fld < 23; fld++)
+    if ((mask & (1L << fld)) &&
+        (gc_fields[fld].obj >= 0) &&
+        !scm_is_eq (a[gc_fields[fld].obj], b[gc_fields[fld].obj]))
+      return 0;
 
-        case XDATA_SEGMENTS:
-          for (i = 0; i < num_data; i++)
-            {
-              ((XSegment *) data)[i].x1 = *vdat++;
-              ((XSegment *) data)[i].y1 = *vdat++;
-              ((XSegment *) data)[i].x2 = *vdat++;
-              ((XSegment *) data)[i].y2 = *vdat++;
-            }
-          break;
+  return 1;
+}
 
-        case XDATA_RECTANGLES:
-          for (i = 0; i < num_data; i++)
-            {
-              ((XRectangle *) data)[i].x      = *vdat++;
-              ((XRectangle *) data)[i].y      = *vdat++;
-              ((XRectangle *) data)[i].width  = *vdat++;
-              ((XRectangle *) data)[i].height = *vdat++;
-            }
-          break;
+/* Free the least recently used GCs that are not in use until there
+   are no more than DSP->pool_max entries, or none left to free. */
+static void trim_gc_pool (xdisplay_t *dsp)
+{
+  while (dsp->pool_count > dsp->pool_max)
+    {
+      int i, lru = -1;
+      xgc_t *gc1;
 
-        default:
-          scm_misc_error (func,
-                          "Internal X data type error (~S)",
-                          scm_list_1 (scm_from_int (type)));
-        }
+      for (i = 0; i < dsp->pool_count; i++)
+        if ((dsp->pool[i].refs == 0) &&
+            ((lru < 0) || (dsp->pool[i].last_use < dsp->pool[lru].last_use)))
+          lru = i;
 
-      /* Now, if we haven't done so before, compare the copied data
-         with the original.  If they are the same, we don't need to do
-         this conversion again in the future. */
-      if ((data_conversion[type] == XDATACONV_UNKNOWN) && (num_data >= 6))
-        {
-          vdat = (short *) scm_array_handle_uniform_elements(&handle);
+      if (lru < 0)
+        return;
 
-          if (memcmp(vdat, data, num_data * datum_size[type]) == 0)
-            {
-              data_conversion[type] = XDATACONV_UNNECESSARY;
-            }
-          else
-            {
-              data_conversion[type] = XDATACONV_REQUIRED;
-            }
-        }
-      
-      /* Set up other return data. */
-      *allocatedp = 1;
-      *count = num_data;
-    }
-  else
-    {
-      /* No need to convert, just return data as is. */
-      data = vdat;
-      *allocatedp = 0;
-      *count = num_data;
-    }
+      gc1 = (xgc_t *) SCM_SMOB_DATA (dsp->pool[lru].gc);
+      XFreeGC (dsp->dsp, gc1->gc);
+      gc1->state = XGC_STATE_FREED;
+      dsp->epoch++;
 
-  scm_array_handle_release(&handle);
-  return data;
+      dsp->pool[lru] = dsp->pool[--dsp->pool_count];
+    }
 }
 
-static SCM draw (SCM window, SCM gc, SCM data, int type, const char *func)
+SCM_DEFINE (scm_x_acquire_gc_x, "x-acquire-gc!", 1, 0, 1,
+            (SCM drawable,
+             SCM changes),
+            "Return a GC from the display's GC pool with the values given\n"
+            "by @var{changes}, which are as for @code{x-create-gc!}, for\n"
+            "use on drawables with the same root and depth as\n"
+            "@var{drawable}.  If the pool holds such a GC it is returned,\n"
+            "otherwise one is created.  A pooled GC may be shared, so it\n"
+            "can be drawn with but not changed.  It should be handed back\n"
+            "with @code{x-release-gc!} when no longer needed.")
+#define FUNC_NAME s_scm_x_acquire_gc_x
 {
+  SCM display1;
   xdisplay_t *dsp;
   xwindow_t *win;
+  unsigned long mask;
+  XGCValues gcv;
+  SCM objs[XGC_NUM_OBJS];
+  xgcpool_entry_t *entry;
   xgc_t *gc1;
-  void *dat;
-  int allocatedp;
-  int num_data = 0;
+  int i;
+
+  display1 = valid_dsp (drawable, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME);
+  dsp = XDISPLAY (display1);
+  win = valid_win (drawable, SCM_ARG1, ~XWINDOW_STATE_DESTROYED, FUNC_NAME);
 
-  dsp = XDISPLAY (valid_dsp (window, SCM_ARG1, XDISPLAY_STATE_OPEN, func));
-  win = valid_win (window, SCM_ARG1, ~XWINDOW_STATE_DESTROYED, func);
-  gc1 = valid_gc (gc, SCM_ARG2, ~XGC_STATE_FREED, func);
-  dat = valid_data (data, SCM_ARG3, type, &allocatedp, &num_data, func);
+  mask = parse_gc_changes (changes, &gcv, objs, FUNC_NAME);
+  drawable_root_depth (dsp, win);
 
-  switch (type)
+  for (i = 0; i < dsp->pool_count; i++)
     {
-    case XDATA_ARCS:
-      XDrawArcs (dsp->dsp,
-                 win->win,
-                 gc1->gc,
-                 (XArc *) dat,
-                 num_data);
-      break;
+      entry = &dsp->pool[i];
 
-    case XDATA_LINES:
-      XDrawLines (dsp->dsp,
-                  win->win,
-                  gc1->gc,
-                  (XPoint *) dat,
-                  num_data,
-                  CoordModeOrigin);
-      break;
+      if ((entry->root == win->root) &&
+          (entry->depth == win->depth) &&
+          (entry->mask == mask) &&
+          gc_values_equal (mask, &entry->values, &gcv) &&
+          gc_objs_equal (mask, XGC (entry->gc)->objs, objs))
+        {
+          entry->refs++;
+          entry->last_use = ++dsp->pool_clock;
+          return entry->gc;
+        }
+    }
 
-    case XDATA_POINTS:
-      XDrawPoints (dsp->dsp,
-                   win->win,
-                   gc1->gc,
-                   (XPoint *) dat,
-                   num_data,
-                   CoordModeOrigin);
-      break;
+  if (dsp->pool_count == dsp->pool_size)
+    {
+      int size = dsp->pool_size ? 2 * dsp->pool_size : 8;
 
-    case XDATA_SEGMENTS:
-      XDrawSegments (dsp->dsp,
-                     win->win,
-                     gc1->gc,
-                     (XSegment *) dat,
-                     num_data);
-      break;
+      dsp->pool = scm_gc_realloc (dsp->pool,
+                                  dsp->pool_size * sizeof (xgcpool_entry_t),
+                                  size * sizeof (xgcpool_entry_t),
+                                  FUNC_NAME);
+      dsp->pool_size = size;
+    }
 
-    case XDATA_RECTANGLES:
-      XDrawRectangles (dsp->dsp,
-                       win->win,
-                       gc1->gc,
-                       (XRectangle *) dat,
-                       num_data);
-      break;
+  gc1 = scm_gc_malloc (sizeof (xgc_t), FUNC_NAME);
 
-    default:
-      scm_misc_error (func,
+  gc1->gc = XCreateGC (dsp->dsp, win->win, mask, &gcv);
+  gc1->dsp = display1;
+  gc1->state = XGC_STATE_POOLED;
+  gc1->transform = SCM_BOOL_F;
+  prime_gc_shadow (dsp, gc1);
+  note_gc_values (gc1, mask, &gcv, objs);
+
+  entry = &dsp->pool[dsp->pool_count++];
+  SCM_NEWSMOB (entry->gc, scm_tc16_xgc, gc1);
+  entry->root = win->root;
+  entry->depth = win->depth;
+  entry->mask = mask;
+  entry->values = gcv;
+  entry->refs = 1;
+  entry->last_use = ++dsp->pool_clock;
+
+  trim_gc_pool (dsp);
+
+  return entry->gc;
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_release_gc_x, "x-release-gc!", 1, 0, 0,
+            (SCM gc),
+            "Hand back @var{gc}, which was returned by\n"
+            "@code{x-acquire-gc!}.  Once every caller that acquired it\n"
+            "has released it, it stays in the pool until the pool holds\n"
+            "more GCs than its size and it is the least recently used\n"
+            "of those not in use.")
+#define FUNC_NAME s_scm_x_release_gc_x
+{
+  xdisplay_t *dsp;
+  int i;
+
+  dsp = XDISPLAY (valid_dsp (gc, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
+  valid_gc (gc, SCM_ARG1, XGC_STATE_POOLED, FUNC_NAME);
+
+  for (i = 0; i < dsp->pool_count; i++)
+    if (scm_is_eq (dsp->pool[i].gc, gc))
+      {
+        if (dsp->pool[i].refs == 0)
+          scm_misc_error (FUNC_NAME,
+                          "GC ~S released more often than acquired",
+                          scm_list_1 (gc));
+
+        dsp->pool[i].refs--;
+        trim_gc_pool (dsp);
+        break;
+      }
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_set_gc_pool_size_x, "x-set-gc-pool-size!", 2, 0, 0,
+            (SCM display,
+             SCM size),
+            "Set the number of GCs that the GC pool of @var{display}\n"
+            "keeps, counting those in use, to @var{size}.  GCs in use are\n"
+            "never freed, so the pool can grow beyond @var{size} while\n"
+            "they are.  The default size is 32.")
+#define FUNC_NAME s_scm_x_set_gc_pool_size_x
+{
+  xdisplay_t *dsp;
+  int size1;
+
+  dsp = XDISPLAY (valid_dsp (display, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
+  SCM_VALIDATE_INT_COPY (SCM_ARG2, size, size1);
+  SCM_ASSERT_RANGE (SCM_ARG2, size, size1 >= 0);
+
+  dsp->pool_max = size1;
+  trim_gc_pool (dsp);
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+/* VISUALS */
+
+/* DefaultVisual */
+
+
+/* COLORMAPS */
+
+/* DefaultColormap */
+
+
+/* TRANSFORMS */
+
+/* A transform is a mutable affine map of drawing coordinates.  It can
+   be passed to the drawing primitives with #:transform, or attached
+   to a GC with x-set-gc-transform!, and is applied in C as the data
+   are converted to Xlib structures; changing it and drawing again is
+   all it takes to pan, zoom or rotate retained geometry.
+
+   Like the corresponding operations of cairo, the procedures that
+   modify a transform apply their translation, scaling or rotation to
+   coordinates before the existing transform. */
+
+int xtransform_print (SCM xf, SCM port, scm_print_state *pstate)
+{
+  xform_t *t = XTRANSFORM (xf);
+
+  scm_puts ("#<x-transform ", port);
+  scm_display (scm_from_double (t->xx), port);
+  scm_putc (' ', port);
+  scm_display (scm_from_double (t->yx), port);
+  scm_putc (' ', port);
+  scm_display (scm_from_double (t->xy), port);
+  scm_putc (' ', port);
+  scm_display (scm_from_double (t->yy), port);
+  scm_putc (' ', port);
+  scm_display (scm_from_double (t->x0), port);
+  scm_putc (' ', port);
+  scm_display (scm_from_double (t->y0), port);
+  scm_putc ('>', port);
+  return 1;
+}
+
+static xform_t * valid_transform (SCM arg, int pos, const char *func)
+{
+  SCM_ASSERT (SCM_NIMP (arg) && (SCM_TYP16 (arg) == scm_tc16_xtransform), arg, pos, func);
+
+  return XTRANSFORM (arg);
+}
+
+SCM_DEFINE (scm_x_make_transform, "x-make-transform", 0, 0, 0,
+            (),
+            "Return a new identity transform.")
+#define FUNC_NAME s_scm_x_make_transform
+{
+  xform_t *t = scm_gc_malloc_pointerless (sizeof (xform_t), FUNC_NAME);
+
+  t->xx = 1; t->yx = 0;
+  t->xy = 0; t->yy = 1;
+  t->x0 = 0; t->y0 = 0;
+
+  SCM_RETURN_NEWSMOB (scm_tc16_xtransform, t);
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_transform_set_x, "x-transform-set!", 7, 0, 0,
+            (SCM xf,
+             SCM xx,
+             SCM yx,
+             SCM xy,
+             SCM yy,
+             SCM x0,
+             SCM y0),
+            "Set @var{xf} to the transform that maps (X, Y) to\n"
+            "(@var{xx} * X + @var{xy} * Y + @var{x0},\n"
+            "@var{yx} * X + @var{yy} * Y + @var{y0}).")
+#define FUNC_NAME s_scm_x_transform_set_x
+{
+  xform_t *t = valid_transform (xf, SCM_ARG1, FUNC_NAME);
+
+  t->xx = scm_to_double (xx);
+  t->yx = scm_to_double (yx);
+  t->xy = scm_to_double (xy);
+  t->yy = scm_to_double (yy);
+  t->x0 = scm_to_double (x0);
+  t->y0 = scm_to_double (y0);
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_transform_identity_x, "x-transform-identity!", 1, 0, 0,
+            (SCM xf),
+            "Reset @var{xf} to the identity transform.")
+#define FUNC_NAME s_scm_x_transform_identity_x
+{
+  xform_t *t = valid_transform (xf, SCM_ARG1, FUNC_NAME);
+
+  t->xx = 1; t->yx = 0;
+  t->xy = 0; t->yy = 1;
+  t->x0 = 0; t->y0 = 0;
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_transform_translate_x, "x-transform-translate!", 3, 0, 0,
+            (SCM xf,
+             SCM tx,
+             SCM ty),
+            "Modify @var{xf} to translate coordinates by (@var{tx},\n"
+            "@var{ty}) before transforming them as before.")
+#define FUNC_NAME s_scm_x_transform_translate_x
+{
+  xform_t *t = valid_transform (xf, SCM_ARG1, FUNC_NAME);
+  double tx1 = scm_to_double (tx);
+  double ty1 = scm_to_double (ty);
+
+  t->x0 += t->xx * tx1 + t->xy * ty1;
+  t->y0 += t->yx * tx1 + t->yy * ty1;
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_transform_scale_x, "x-transform-scale!", 3, 0, 0,
+            (SCM xf,
+             SCM sx,
+             SCM sy),
+            "Modify @var{xf} to scale coordinates by @var{sx} and\n"
+            "@var{sy} before transforming them as before.")
+#define FUNC_NAME s_scm_x_transform_scale_x
+{
+  xform_t *t = valid_transform (xf, SCM_ARG1, FUNC_NAME);
+  double sx1 = scm_to_double (sx);
+  double sy1 = scm_to_double (sy);
+
+  t->xx *= sx1;
+  t->yx *= sx1;
+  t->xy *= sy1;
+  t->yy *= sy1;
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_transform_rotate_x, "x-transform-rotate!", 2, 0, 0,
+            (SCM xf,
+             SCM angle),
+            "Modify @var{xf} to rotate coordinates by @var{angle}\n"
+            "radians before transforming them as before.  Rectangles\n"
+            "and arcs cannot be drawn through a rotating transform.")
+#define FUNC_NAME s_scm_x_transform_rotate_x
+{
+  xform_t *t = valid_transform (xf, SCM_ARG1, FUNC_NAME);
+  double c = scm_to_double (scm_cos (angle));
+  double s = scm_to_double (scm_sin (angle));
+  double xx = t->xx, yx = t->yx, xy = t->xy, yy = t->yy;
+
+  t->xx =  xx * c + xy * s;
+  t->yx =  yx * c + yy * s;
+  t->xy = -xx * s + xy * c;
+  t->yy = -yx * s + yy * c;
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_transform_to_vector, "x-transform->vector", 1, 0, 0,
+            (SCM xf),
+            "Return the coefficients of @var{xf} as a vector\n"
+            "#(XX YX XY YY X0 Y0), as taken by @code{x-transform-set!}.")
+#define FUNC_NAME s_scm_x_transform_to_vector
+{
+  xform_t *t = valid_transform (xf, SCM_ARG1, FUNC_NAME);
+  SCM v = scm_c_make_vector (6, SCM_BOOL_F);
+
+  scm_c_vector_set_x (v, 0, scm_from_double (t->xx));
+  scm_c_vector_set_x (v, 1, scm_from_double (t->yx));
+  scm_c_vector_set_x (v, 2, scm_from_double (t->xy));
+  scm_c_vector_set_x (v, 3, scm_from_double (t->yy));
+  scm_c_vector_set_x (v, 4, scm_from_double (t->x0));
+  scm_c_vector_set_x (v, 5, scm_from_double (t->y0));
+
+  return v;
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_set_gc_transform_x, "x-set-gc-transform!", 2, 0, 0,
+            (SCM gc,
+             SCM xf),
+            "Attach the transform @var{xf} to @var{gc}, or detach any\n"
+            "transform if @var{xf} is #f.  Drawings made with @var{gc}\n"
+            "and without a @code{#:transform} option then have their\n"
+            "coordinates mapped through @var{xf}, as it is at the time\n"
+            "of drawing.")
+#define FUNC_NAME s_scm_x_set_gc_transform_x
+{
+  xgc_t *gc1 = valid_gc (gc, SCM_ARG1, (XGC_STATE_CREATED | XGC_STATE_DEFAULT), FUNC_NAME);
+
+  if (scm_is_true (xf))
+    valid_transform (xf, SCM_ARG2, FUNC_NAME);
+  gc1->transform = xf;
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+
+/* DRAWING (NON-TEXT) */
+
+SCM_SYMBOL (sym_s16, "s16");
+
+static int shorts_per_datum[XDATA_NUM_TYPES] = { 6, 2, 2, 4, 4, 6, 2, 4 };
+
+#define XDATACONV_UNKNOWN     0
+#define XDATACONV_REQUIRED    1
+#define XDATACONV_UNNECESSARY 2
+
+/* Whether packed shorts can be handed to Xlib as they are, for each
+   data type.  This only depends on the layout of the Xlib structures,
+   so init_data_conversion works it out once, at initialization. */
+static int data_conversion[XDATA_NUM_TYPES] = {
+  XDATACONV_UNKNOWN,
+  XDATACONV_UNKNOWN,
+  XDATACONV_UNKNOWN,
+  XDATACONV_UNKNOWN,
+  XDATACONV_UNKNOWN,
+  XDATACONV_UNKNOWN,
+  XDATACONV_UNKNOWN,
+  XDATACONV_UNKNOWN
+};
+
+static int datum_size[XDATA_NUM_TYPES] = {
+  sizeof (XArc),
+  sizeof (XPoint),
+  sizeof (XPoint),
+  sizeof (XSegment),
+  sizeof (XRectangle),
+  sizeof (XArc),
+  sizeof (XPoint),
+  sizeof (XRectangle)
+};
+
+/* The kind of geometry buffer that holds data of each type. */
+static int geometry_kind[XDATA_NUM_TYPES] = {
+  XDATA_ARCS,
+  XDATA_POINTS,
+  XDATA_POINTS,
+  XDATA_SEGMENTS,
+  XDATA_RECTANGLES,
+  XDATA_ARCS,
+  XDATA_POINTS,
+  XDATA_RECTANGLES
+};
+
+static void init_data_conversion (void)
+{
+  int type;
+
+  /* All the Xlib drawing structures are made of shorts, declared in
+     the same order as the elements of a datum; if there is no
+     padding, packed shorts already have the right layout. */
+  for (type = 0; type < XDATA_NUM_TYPES; type++)
+    if (datum_size[type] == shorts_per_datum[type] * sizeof (short))
+      data_conversion[type] = XDATACONV_UNNECESSARY;
+    else
+      data_conversion[type] = XDATACONV_REQUIRED;
+}
+
+/* Copy NUM_DATA data of type TYPE into Xlib structures at DATA.
+   Successive data start ROW_INC shorts apart in VDAT, and successive
+   elements of a datum COL_INC shorts apart. */
+static void convert_data (void *data,
+                          const short *vdat,
+                          ssize_t row_inc,
+                          ssize_t col_inc,
+                          int num_data,
+                          int type,
+                          const char *func)
+{
+  int i;
+
+#define V(k) (vdat[(k) * col_inc])
+  switch (type)
+    {
+    case XDATA_ARCS:
+    case XDATA_FILL_ARCS:
+      for (i = 0; i < num_data; i++, vdat += row_inc)
+        {
+          ((XArc *) data)[i].x      = V (0);
+          ((XArc *) data)[i].y      = V (1);
+          ((XArc *) data)[i].width  = V (2);
+          ((XArc *) data)[i].height = V (3);
+          ((XArc *) data)[i].angle1 = V (4);
+          ((XArc *) data)[i].angle2 = V (5);
+        }
+      break;
+
+    case XDATA_LINES:
+    case XDATA_POINTS:
+    case XDATA_FILL_POLYGON:
+      for (i = 0; i < num_data; i++, vdat += row_inc)
+        {
+          ((XPoint *) data)[i].x = V (0);
+          ((XPoint *) data)[i].y = V (1);
+        }
+      break;
+
+    case XDATA_SEGMENTS:
+      for (i = 0; i < num_data; i++, vdat += row_inc)
+        {
+          ((XSegment *) data)[i].x1 = V (0);
+          ((XSegment *) data)[i].y1 = V (1);
+          ((XSegment *) data)[i].x2 = V (2);
+          ((XSegment *) data)[i].y2 = V (3);
+        }
+      break;
+
+    case XDATA_RECTANGLES:
+    case XDATA_FILL_RECTANGLES:
+      for (i = 0; i < num_data; i++, vdat += row_inc)
+        {
+          ((XRectangle *) data)[i].x      = V (0);
+          ((XRectangle *) data)[i].y      = V (1);
+          ((XRectangle *) data)[i].width  = V (2);
+          ((XRectangle *) data)[i].height = V (3);
+        }
+      break;
+
+    default:
+      scm_misc_error (func,
+                      "Internal X data type error (~S)",
+                      scm_list_1 (scm_from_int (type)));
+    }
+#undef V
+}
+
+/* CONVERSION FROM OTHER NUMERIC TYPES */
+
+SCM_SYMBOL (sym_s32, "s32");
+SCM_SYMBOL (sym_f32, "f32");
+SCM_SYMBOL (sym_f64, "f64");
+
+/* Element types of the arrays accepted as drawing data. */
+#define XELT_S16 0
+#define XELT_S32 1
+#define XELT_F32 2
+#define XELT_F64 3
+
+/* The elements of a datum are taken in pairs, (X, Y), (WIDTH, HEIGHT)
+   or (ANGLE1, ANGLE2), and each pair is mapped as
+
+     (A, B) -> (A, B) * DIAG + (B, A) * CROSS + OFF
+
+   and then clamped to LO..HI and rounded to the nearest short. */
+typedef struct pair_xform_t
+{
+  double diag[2];
+  double cross[2];
+  double off[2];
+  double lo[2];
+  double hi[2];
+
+} pair_xform_t;
+
+/* Set up the pair transformations for data of type TYPE, mapped
+   through XFORM (or not, if XFORM is NULL).  Return the number of
+   pairs in a datum. */
+static int setup_pair_xform (pair_xform_t *px, int type, const xform_t *xform, const char *func)
+{
+  static const xform_t identity = { 1, 0, 0, 1, 0, 0 };
+  int num_pairs = shorts_per_datum[type] / 2;
+  int p;
+
+  if (!xform)
+    xform = &identity;
+
+  for (p = 0; p < num_pairs; p++)
+    {
+      pair_xform_t *c = &px[p];
+
+      c->lo[0] = c->lo[1] = SHRT_MIN;
+      c->hi[0] = c->hi[1] = SHRT_MAX;
+
+      if (p == 0)
+        {
+          /* Coordinates. */
+          c->diag[0]  = xform->xx;
+          c->diag[1]  = xform->yy;
+          c->cross[0] = xform->xy;
+          c->cross[1] = xform->yx;
+          c->off[0]   = xform->x0;
+          c->off[1]   = xform->y0;
+        }
+      else if ((p == 1) &&
+               ((type == XDATA_SEGMENTS) ||
+                (type == XDATA_LINES) || (type == XDATA_POINTS) ||
+                (type == XDATA_FILL_POLYGON)))
+        {
+          /* The second end point of a segment. */
+          *c = px[0];
+        }
+      else if (p == 1)
+        {
+          /* Width and height of a rectangle or arc, which can be
+             scaled but not rotated.  A flip is made good by
+             fix_flipped_boxes.  x-transform-rotate! leaves rounding
+             residue in the cross terms of, say, a half turn, so
+             those negligible next to the scale count as zero. */
+          double ax = (xform->xx < 0) ? -xform->xx : xform->xx;
+          double ay = (xform->yy < 0) ? -xform->yy : xform->yy;
+          double bxy = (xform->xy < 0) ? -xform->xy : xform->xy;
+          double byx = (xform->yx < 0) ? -xform->yx : xform->yx;
+          double eps = 1e-9 * (ax > ay ? ax : ay);
+
+          if ((bxy > eps) || (byx > eps))
+            scm_misc_error (func,
+                            "Rectangles and arcs cannot be rotated",
+                            SCM_EOL);
+          c->diag[0]  = ax;
+          c->diag[1]  = ay;
+          c->cross[0] = c->cross[1] = 0;
+          c->off[0]   = c->off[1] = 0;
+          c->lo[0]    = c->lo[1] = 0;
+        }
+      else
+        {
+          /* Arc angles. */
+          c->diag[0]  = c->diag[1] = 1;
+          c->cross[0] = c->cross[1] = 0;
+          c->off[0]   = c->off[1] = 0;
+        }
+    }
+
+  return num_pairs;
+}
+
+/* Clamp V to LO..HI and round it to the nearest integer, halves to
+   even.  A NaN becomes LO.  This gives the same results as the SSE2
+   kernel below. */
+static short saturate_short (double v, double lo, double hi)
+{
+  /* Adding and subtracting 1.5 * 2^52 rounds a double of magnitude
+     less than 2^51 to an integer, in the default rounding mode. */
+  volatile double r;
+
+  if (!(v >= lo))
+    v = lo;
+  else if (v > hi)
+    v = hi;
+
+  r = v + 6755399441055744.0;
+  return (short) (r - 6755399441055744.0);
+}
+
+/* Transform NUM_DATA contiguous data of NUM_PAIRS pairs of elements
+   of type ELT at IN into packed shorts at OUT.  This is where the
+   time goes when drawing large arrays of floating point data, so for
+   SSE2 each pair is transformed, clamped, converted and packed to
+   shorts in vector registers. */
+#ifdef __SSE2__
+
+#define XFORM_PAIRS_LOOP(LOAD)                                          \
+  for (i = 0, p = 0; i < n; i++)                                        \
+    {                                                                   \
+      __m128d v = LOAD;                                                 \
+      __m128i iv;                                                       \
+                                                                        \
+      v = _mm_add_pd (_mm_add_pd (_mm_mul_pd (v, diag[p]),              \
+                                  _mm_mul_pd (_mm_shuffle_pd (v, v, 1), \
+                                              cross[p])),               \
+                      off[p]);                                          \
+      v = _mm_min_pd (_mm_max_pd (v, lo[p]), hi[p]);                    \
+      iv = _mm_cvtpd_epi32 (v);                                         \
+      iv = _mm_packs_epi32 (iv, iv);                                    \
+      word = _mm_cvtsi128_si32 (iv);                                    \
+      memcpy (out + 2 * i, &word, sizeof (word));                       \
+                                                                        \
+      if (++p == num_pairs)                                             \
+        p = 0;                                                          \
+    }
+
+static void transform_pairs (short *out,
+                             const void *in,
+                             int elt,
+                             size_t num_data,
+                             const pair_xform_t *px,
+                             int num_pairs)
+{
+  __m128d diag[3], cross[3], off[3], lo[3], hi[3];
+  size_t i, n = num_data * num_pairs;
+  int p, word;
+
+  for (p = 0; p < num_pairs; p++)
+    {
+      diag[p]  = _mm_loadu_pd (px[p].diag);
+      cross[p] = _mm_loadu_pd (px[p].cross);
+      off[p]   = _mm_loadu_pd (px[p].off);
+      lo[p]    = _mm_loadu_pd (px[p].lo);
+      hi[p]    = _mm_loadu_pd (px[p].hi);
+    }
+
+  switch (elt)
+    {
+    case XELT_S16:
+      XFORM_PAIRS_LOOP (_mm_set_pd (((const short *) in)[2 * i + 1],
+                                    ((const short *) in)[2 * i]));
+      break;
+
+    case XELT_S32:
+      XFORM_PAIRS_LOOP (_mm_cvtepi32_pd
+                        (_mm_loadl_epi64 ((const __m128i *)
+                                          ((const scm_t_int32 *) in + 2 * i))));
+      break;
+
+    case XELT_F32:
+      XFORM_PAIRS_LOOP (_mm_cvtps_pd
+                        (_mm_castsi128_ps
+                         (_mm_loadl_epi64 ((const __m128i *)
+                                           ((const float *) in + 2 * i)))));
+      break;
+
+    case XELT_F64:
+      XFORM_PAIRS_LOOP (_mm_loadu_pd ((const double *) in + 2 * i));
+      break;
+    }
+}
+
+#undef XFORM_PAIRS_LOOP
+
+#else /* !__SSE2__ */
+
+static void transform_pairs (short *out,
+                             const void *in,
+                             int elt,
+                             size_t num_data,
+                             const pair_xform_t *px,
+                             int num_pairs)
+{
+  size_t i, n = num_data * num_pairs;
+  int p;
+
+  for (i = 0, p = 0; i < n; i++)
+    {
+      const pair_xform_t *c = &px[p];
+      double a, b;
+
+      switch (elt)
+        {
+        case XELT_S16:
+          a = ((const short *) in)[2 * i];
+          b = ((const short *) in)[2 * i + 1];
+          break;
+        case XELT_S32:
+          a = ((const scm_t_int32 *) in)[2 * i];
+          b = ((const scm_t_int32 *) in)[2 * i + 1];
+          break;
+        case XELT_F32:
+          a = ((const float *) in)[2 * i];
+          b = ((const float *) in)[2 * i + 1];
+          break;
+        default:
+          a = ((const double *) in)[2 * i];
+          b = ((const double *) in)[2 * i + 1];
+          break;
+        }
+
+      out[2 * i]     = saturate_short (a * c->diag[0] + b * c->cross[0] + c->off[0],
+                                       c->lo[0], c->hi[0]);
+      out[2 * i + 1] = saturate_short (b * c->diag[1] + a * c->cross[1] + c->off[1],
+                                       c->lo[1], c->hi[1]);
+
+      if (++p == num_pairs)
+        p = 0;
+    }
+}
+
+#endif /* !__SSE2__ */
+
+/* Return element K of an array of element type ELT. */
+static double element_ref (const void *in, int elt, ssize_t k)
+{
+  switch (elt)
+    {
+    case XELT_S16: return ((const short *) in)[k];
+    case XELT_S32: return ((const scm_t_int32 *) in)[k];
+    case XELT_F32: return ((const float *) in)[k];
+    default:       return ((const double *) in)[k];
+    }
+}
+
+/* As transform_pairs, for data that are not contiguous: successive
+   data start ROW_INC elements apart, and successive elements of a
+   datum COL_INC elements apart. */
+static void transform_pairs_strided (short *out,
+                                     const void *in,
+                                     int elt,
+                                     ssize_t row_inc,
+                                     ssize_t col_inc,
+                                     size_t num_data,
+                                     const pair_xform_t *px,
+                                     int num_pairs)
+{
+  size_t i;
+  int p;
+
+  for (i = 0; i < num_data; i++)
+    for (p = 0; p < num_pairs; p++, out += 2)
+      {
+        const pair_xform_t *c = &px[p];
+        ssize_t k = i * row_inc + 2 * p * col_inc;
+        double a = element_ref (in, elt, k);
+        double b = element_ref (in, elt, k + col_inc);
+
+        out[0] = saturate_short (a * c->diag[0] + b * c->cross[0] + c->off[0],
+                                 c->lo[0], c->hi[0]);
+        out[1] = saturate_short (b * c->diag[1] + a * c->cross[1] + c->off[1],
+                                 c->lo[1], c->hi[1]);
+      }
+}
+
+/* Return A - B, saturated to the range of a short. */
+static short sub_saturate (int a, int b)
+{
+  int d = a - b;
+
+  return (d < SHRT_MIN) ? SHRT_MIN : (d > SHRT_MAX) ? SHRT_MAX : d;
+}
+
+/* As transform_pairs_strided, for NUM_DATA points each of which but
+   the first is relative to the point before.  Rounding each delta on
+   its own would let the errors build up along the path, so the
+   points are summed in double precision, mapped through PX and
+   rounded, and the results delta-encoded again. */
+static void transform_relative_points (short *out,
+                                       const void *in,
+                                       int elt,
+                                       ssize_t row_inc,
+                                       ssize_t col_inc,
+                                       size_t num_data,
+                                       const pair_xform_t *px)
+{
+  double a = 0, b = 0;
+  short x = 0, y = 0;
+  size_t i;
+
+  for (i = 0; i < num_data; i++, out += 2)
+    {
+      short x1, y1;
+
+      a += element_ref (in, elt, i * row_inc);
+      b += element_ref (in, elt, i * row_inc + col_inc);
+      x1 = saturate_short (a * px->diag[0] + b * px->cross[0] + px->off[0],
+                           px->lo[0], px->hi[0]);
+      y1 = saturate_short (b * px->diag[1] + a * px->cross[1] + px->off[1],
+                           px->lo[1], px->hi[1]);
+
+      out[0] = i ? sub_saturate (x1, x) : x1;
+      out[1] = i ? sub_saturate (y1, y) : y1;
+      x = x1;
+      y = y1;
+    }
+}
+
+/* After rectangles or arcs in packed shorts at OUT have been mapped
+   through XFORM, move the origin of any box that XFORM flips to its
+   new top left corner, and mirror the angles of arcs accordingly. */
+static void fix_flipped_boxes (short *out, size_t num_data, int type, const xform_t *xform)
+{
+  int k = shorts_per_datum[type];
+  int arcs = (type == XDATA_ARCS) || (type == XDATA_FILL_ARCS);
+  size_t i;
+
+  if ((xform->xx >= 0) && (xform->yy >= 0))
+    return;
+
+  for (i = 0; i < num_data; i++, out += k)
+    {
+      if (xform->xx < 0)
+        {
+          out[0] = sub_saturate (out[0], out[2]);
+          if (arcs)
+            {
+              out[4] = sub_saturate (180 * 64, out[4]);
+              out[5] = sub_saturate (0, out[5]);
+            }
+        }
+      if (xform->yy < 0)
+        {
+          out[1] = sub_saturate (out[1], out[3]);
+          if (arcs)
+            {
+              out[4] = sub_saturate (0, out[4]);
+              out[5] = sub_saturate (0, out[5]);
+            }
+        }
+    }
+}
+
+/* Return storage of SIZE bytes for XD's converted copy: XD's scratch
+   storage if it fits, otherwise taken from the display's arena. */
+static void * copy_storage (xdata_t *xd, size_t size, const char *func)
+{
+  if (size <= xd->scratch_size)
+    return xd->scratch;
+
+  xd->allocated = size;
+  return scratch_alloc (xd->dsp, size, func);
+}
+
+/* Fill in XD with NUM_DATA data of type TYPE, converted from the
+   elements of type ELT at ELEMENTS.  Successive data start ROW_INC
+   elements apart, and successive elements of a datum COL_INC elements
+   apart.  If XFORM is not NULL, coordinates are mapped through it.
+   If RELATIVE is nonzero, the data are points each relative to the
+   point before, but the first. */
+static void convert_elements (xdata_t *xd,
+                              const void *elements,
+                              int elt,
+                              ssize_t row_inc,
+                              ssize_t col_inc,
+                              size_t num_data,
+                              int type,
+                              const xform_t *xform,
+                              int relative,
+                              const char *func)
+{
+  int num_shorts_per_datum = shorts_per_datum[type];
+  int contiguous = (col_inc == 1) && ((row_inc == num_shorts_per_datum) || (num_data <= 1));
+  pair_xform_t px[3];
+  short *shorts;
+  int num_pairs;
+
+  xd->count = num_data;
+
+  if ((elt == XELT_S16) && !xform)
+    {
+      /* Can the storage be handed to Xlib as it is?  That needs the
+         data to be packed, as well as the Xlib structures to have the
+         same layout as packed shorts. */
+      if ((data_conversion[type] == XDATACONV_UNNECESSARY) && contiguous)
+        {
+          xd->data = (void *) elements;
+          return;
+        }
+
+      /* No: make a converted copy. */
+      xd->data = copy_storage (xd, num_data * datum_size[type], func);
+      convert_data (xd->data, elements, row_inc, col_inc, num_data, type, func);
+      return;
+    }
+
+  /* Other element types, and transformed data, are converted to
+     packed shorts; these are then converted to Xlib structures if
+     the layouts differ. */
+  num_pairs = setup_pair_xform (px, type, xform, func);
+
+  xd->data = copy_storage (xd, num_data * datum_size[type], func);
+
+  if (data_conversion[type] == XDATACONV_UNNECESSARY)
+    shorts = xd->data;
+  else
+    shorts = scratch_alloc (xd->dsp, num_data * num_shorts_per_datum * sizeof (short),
+                            func);
+
+  if (relative)
+    transform_relative_points (shorts, elements, elt, row_inc, col_inc,
+                               num_data, px);
+  else if (contiguous)
+    transform_pairs (shorts, elements, elt, num_data, px, num_pairs);
+  else
+    transform_pairs_strided (shorts, elements, elt, row_inc, col_inc,
+                             num_data, px, num_pairs);
+
+  if (xform &&
+      ((type == XDATA_ARCS) || (type == XDATA_RECTANGLES) ||
+       (type == XDATA_FILL_ARCS) || (type == XDATA_FILL_RECTANGLES)))
+    fix_flipped_boxes (shorts, num_data, type, xform);
+
+  if (shorts != xd->data)
+    convert_data (xd->data, shorts, num_shorts_per_datum, 1, num_data, type, func);
+}
+
+/* Check that ARG is valid drawing data of type TYPE, and fill in XD
+   so that XD->data can be passed to Xlib.  ARG may be an s16, s32,
+   f32 or f64 array of dimensions N x shorts_per_datum[TYPE], a
+   one-dimensional array of N * shorts_per_datum[TYPE] such elements,
+   a bytevector holding N packed Xlib structures, or a geometry
+   buffer of the right kind.  Values outside the range of the Xlib
+   structures are clamped to it.  If XFORM is
+   not NULL, coordinates are mapped through it.  Contiguous s16 data,
+   and geometry buffers, that need no transformation are used in
+   place; copies are taken from the scratch arena of DSP, which the
+   caller must have reset.  The caller must
+   call release_data when done with XD. */
+static void valid_data (SCM arg,
+                        int pos,
+                        int type,
+                        const xform_t *xform,
+                        xdisplay_t *dsp,
+                        xdata_t *xd,
+                        const char *func)
+{
+  valid_data_scratch (arg, pos, type, xform, 0, NULL, 0, dsp, xd, func);
+}
+
+/* The same, but converting into the SCRATCH_SIZE bytes at SCRATCH
+   rather than allocating, if the converted data fit.  If RELATIVE is
+   nonzero, each point of the data but the first is relative to the
+   point before, and stays so after conversion. */
+static void valid_data_scratch (SCM arg,
+                                int pos,
+                                int type,
+                                const xform_t *xform,
+                                int relative,
+                                void *scratch,
+                                size_t scratch_size,
+                                xdisplay_t *dsp,
+                                xdata_t *xd,
+                                const char *func)
+#define FUNC_NAME func
+{
+  scm_t_array_dim *dims;
+  int num_shorts_per_datum;
+  size_t num_data;
+  ssize_t row_inc, col_inc;
+  const void *elements;
+  int elt;
+
+  xd->allocated = 0;
+  xd->dsp = dsp;
+  xd->scratch = scratch;
+  xd->scratch_size = scratch ? scratch_size : 0;
+  xd->handlep = 0;
+  xd->runs = NULL;
+  xd->num_runs = 0;
+
+  if (SCM_NIMP (arg) && (SCM_TYP16 (arg) == scm_tc16_xgeom))
+    {
+      xgeom_t *geom = XGEOM (arg);
+
+      if ((geom->count > 0) && (geom->kind != geometry_kind[type]))
+        scm_misc_error (func,
+                        "Geometry buffer ~S holds the wrong kind of data",
+                        scm_list_1 (arg));
+      SCM_ASSERT_RANGE (pos, arg, geom->count <= INT_MAX);
+
+      convert_elements (xd, geom->data, XELT_S16,
+                        shorts_per_datum[type], 1,
+                        geom->count, type, xform, relative, func);
+      return;
+    }
+
+  if (scm_is_bytevector (arg))
+    {
+      size_t len = SCM_BYTEVECTOR_LENGTH (arg);
+
+      if (xform)
+        scm_misc_error (func,
+                        "Bytevector data cannot be transformed",
+                        SCM_EOL);
+      if (len % datum_size[type] != 0)
+        scm_misc_error (func,
+                        "Bytevector length ~S is not a multiple of ~S",
+                        scm_list_2 (scm_from_size_t (len),
+                                    scm_from_int (datum_size[type])));
+      num_data = len / datum_size[type];
+      SCM_ASSERT_RANGE (pos, arg, num_data <= INT_MAX);
+
+      xd->data  = SCM_BYTEVECTOR_CONTENTS (arg);
+      xd->count = num_data;
+      return;
+    }
+
+  /* Otherwise the data must be a uniform numeric array. */
+  if (scm_is_typed_array (arg, sym_s16))
+    elt = XELT_S16;
+  else if (scm_is_typed_array (arg, sym_s32))
+    elt = XELT_S32;
+  else if (scm_is_typed_array (arg, sym_f32))
+    elt = XELT_F32;
+  else if (scm_is_typed_array (arg, sym_f64))
+    elt = XELT_F64;
+  else
+    scm_wrong_type_arg (func, pos, arg);
+
+  scm_array_get_handle (arg, &xd->handle);
+  xd->handlep = 1;
+  dims = scm_array_handle_dims (&xd->handle);
+
+  switch (scm_array_handle_rank (&xd->handle))
+    {
+    case 1:
+      /* Flat vector: N data laid end to end. */
+      num_shorts_per_datum = shorts_per_datum[type];
+      if ((dims[0].ubnd - dims[0].lbnd + 1) % num_shorts_per_datum != 0)
+        scm_misc_error (func,
+                        "Data has incorrect length (~S, expected a multiple of ~S)",
+                        scm_list_2 (scm_from_long (dims[0].ubnd - dims[0].lbnd + 1),
+                                    scm_from_int (num_shorts_per_datum)));
+      num_data = (dims[0].ubnd - dims[0].lbnd + 1) / num_shorts_per_datum;
+      col_inc  = dims[0].inc;
+      row_inc  = dims[0].inc * num_shorts_per_datum;
+      break;
+
+    case 2:
+      num_data             = dims[0].ubnd - dims[0].lbnd + 1;
+      num_shorts_per_datum = dims[1].ubnd - dims[1].lbnd + 1;
+      if (num_shorts_per_datum != shorts_per_datum[type])
+        scm_misc_error (func,
+                        "Data has incorrect dimensions (~S, expected ~S)",
+                        scm_list_2 (scm_from_int (num_shorts_per_datum),
+                                    scm_from_int (shorts_per_datum[type])));
+      row_inc = dims[0].inc;
+      col_inc = dims[1].inc;
+      break;
+
+    default:
+      scm_array_handle_release (&xd->handle);
+      xd->handlep = 0;
+      scm_wrong_type_arg (func, pos, arg);
+    }
+
+  SCM_ASSERT_RANGE (pos, arg, num_data <= INT_MAX);
+
+  switch (elt)
+    {
+    case XELT_S16: elements = scm_array_handle_s16_elements (&xd->handle); break;
+    case XELT_S32: elements = scm_array_handle_s32_elements (&xd->handle); break;
+    case XELT_F32: elements = scm_array_handle_f32_elements (&xd->handle); break;
+    default:       elements = scm_array_handle_f64_elements (&xd->handle); break;
+    }
+
+  convert_elements (xd, elements, elt, row_inc, col_inc, num_data, type, xform, relative, func);
+}
+#undef FUNC_NAME
+
+/* Release the array handle of XD.  Copies of the data, and runs, are
+   in the display's scratch arena, which the next primitive resets. */
+static void release_data (xdata_t *xd, const char *func)
+{
+  xd->allocated = 0;
+
+  if (xd->handlep)
+    scm_array_handle_release (&xd->handle);
+  xd->handlep = 0;
+
+  xd->runs = NULL;
+}
+
+/* Length of the protocol request header for each data type, and of
+   each datum on the wire, in 4-byte units. */
+static int request_header_units[XDATA_NUM_TYPES] = { 3, 3, 3, 3, 3, 3, 4, 3 };
+static int datum_units[XDATA_NUM_TYPES] = { 3, 1, 1, 2, 2, 3, 1, 2 };
+
+/* Return the largest number of data of type TYPE that fit in a single
+   request to the server of DSP. */
+static int max_request_data (xdisplay_t *dsp, int type)
+{
+  long n;
+
+  if (dsp->max_request == 0)
+    {
+      /* XExtendedMaxRequestSize is 0 unless the server offers
+         BIG-REQUESTS, which Xlib enables when connecting. */
+      dsp->max_request = XExtendedMaxRequestSize (dsp->dsp);
+      dsp->bigreq = (dsp->max_request != 0);
+      if (!dsp->bigreq)
+        dsp->max_request = XMaxRequestSize (dsp->dsp);
+    }
+
+  n = (dsp->max_request - request_header_units[type] - dsp->bigreq) / datum_units[type];
+
+  return (n > INT_MAX) ? INT_MAX : n;
+}
+
+/* Raise an error if NUM_DATA data of type TYPE are a polygon too big
+   for a single request to the server of DSP.  A polygon can't be
+   split, since each request would be filled as a polygon of its own. */
+static void check_polygon_size (xdisplay_t *dsp, int type, int num_data, const char *func)
+{
+  int max_data;
+
+  if (type != XDATA_FILL_POLYGON)
+    return;
+
+  max_data = max_request_data (dsp, type);
+  if (num_data > max_data)
+    scm_misc_error (func,
+                    "Polygon has too many points for one request (~S, maximum ~S)",
+                    scm_list_2 (scm_from_int (num_data), scm_from_int (max_data)));
+}
+
+/* Issue a single Xlib drawing request for NUM_DATA data at DAT.
+   MODE is the coordinate mode of points, lines and polygons. */
+static void draw_request (Display *d,
+                          Drawable w,
+                          GC gc,
+                          int type,
+                          void *dat,
+                          int num_data,
+                          int shape,
+                          int mode,
+                          const char *func)
+{
+  switch (type)
+    {
+    case XDATA_ARCS:
+      XDrawArcs (d, w, gc, (XArc *) dat, num_data);
+      break;
+
+    case XDATA_LINES:
+      XDrawLines (d, w, gc, (XPoint *) dat, num_data, mode);
+      break;
+
+    case XDATA_POINTS:
+      XDrawPoints (d, w, gc, (XPoint *) dat, num_data, mode);
+      break;
+
+    case XDATA_SEGMENTS:
+      XDrawSegments (d, w, gc, (XSegment *) dat, num_data);
+      break;
+
+    case XDATA_RECTANGLES:
+      XDrawRectangles (d, w, gc, (XRectangle *) dat, num_data);
+      break;
+
+    case XDATA_FILL_ARCS:
+      XFillArcs (d, w, gc, (XArc *) dat, num_data);
+      break;
+
+    case XDATA_FILL_POLYGON:
+      XFillPolygon (d, w, gc, (XPoint *) dat, num_data, shape, mode);
+      break;
+
+    case XDATA_FILL_RECTANGLES:
+      XFillRectangles (d, w, gc, (XRectangle *) dat, num_data);
+      break;
+
+    default:
+      scm_misc_error (func,
+                      "Internal X data type error (~S)",
+                      scm_list_1 (scm_from_int (type)));
+    }
+}
+
+/* Return A + B, saturated to the range of a short. */
+static short add_saturate (int a, int b)
+{
+  int d = a + b;
+
+  return (d < SHRT_MIN) ? SHRT_MIN : (d > SHRT_MAX) ? SHRT_MAX : d;
+}
+
+/* Draw NUM_DATA data of type TYPE at DAT, splitting them into as many
+   requests as the server's maximum request length requires.  Not all
+   Xlib drawing functions split oversized requests themselves (XDrawArcs,
+   XDrawLines and XFillPolygon don't), so this is done here for all
+   types alike.  Each request is sent straight from DAT.
+
+   A polyline is split into requests that share their end points, so
+   that it stays connected; the join at such a point is drawn as two
+   caps, and a dash pattern restarts there.
+
+   With CoordModePrevious, the first point of each request after the
+   first must be made absolute, so the points are then split from a
+   copy of DAT. */
+static void draw_data (xdisplay_t *dsp,
+                       Drawable d,
+                       GC gc,
+                       int type,
+                       void *dat,
+                       int num_data,
+                       int shape,
+                       int mode,
+                       const char *func)
+{
+  int max_data = max_request_data (dsp, type);
+  char *p = (char *) dat;
+  XPoint *copy = NULL;
+  int n;
+
+  check_polygon_size (dsp, type, num_data, func);
+
+  if ((mode == CoordModePrevious) && (num_data > max_data))
+    {
+      copy = scratch_alloc (dsp, num_data * sizeof (XPoint), func);
+      memcpy (copy, dat, num_data * sizeof (XPoint));
+      p = (char *) copy;
+    }
+
+  do
+    {
+      n = (num_data > max_data) ? max_data : num_data;
+
+      draw_request (dsp->dsp, d, gc, type, p, n, shape, mode, func);
+
+      if ((type == XDATA_LINES) && (n < num_data) && (n > 1))
+        n--;
+
+      if (copy && (n < num_data))
+        {
+          /* Make the point that the next request starts with
+             absolute. */
+          XPoint *pts = (XPoint *) p;
+          int i, x = pts[0].x, y = pts[0].y;
+
+          for (i = 1; i <= n; i++)
+            {
+              x = add_saturate (x, pts[i].x);
+              y = add_saturate (y, pts[i].y);
+            }
+          pts[n].x = x;
+          pts[n].y = y;
+        }
+
+      p += n * datum_size[type];
+      num_data -= n;
+    }
+  while (num_data > 0);
+}
+
+/* DRAWING OPTIONS */
+
+SCM_KEYWORD (kw_bounds, "bounds");
+SCM_KEYWORD (kw_decimate, "decimate");
+SCM_KEYWORD (kw_simplify, "simplify");
+SCM_KEYWORD (kw_transform, "transform");
+SCM_KEYWORD (kw_relative, "relative");
+SCM_KEYWORD (kw_mode, "mode");
+
+/* Parse the keyword arguments OPTIONS of a drawing primitive into
+   OPTS.  The options are:
+
+   #:bounds #(X Y WIDTH HEIGHT)
+     Cull the data that fall outside the given rectangle before
+     sending them to the server, and clip lines and segments that
+     cross its edges.
+
+   #:decimate BOOL
+     Reduce a polyline to at most four points per pixel column.
+
+   #:simplify TOLERANCE
+     Simplify a polyline with the Douglas-Peucker algorithm.
+
+   #:transform TRANSFORM
+   #:transform #(SCALE-X SCALE-Y TRANSLATE-X TRANSLATE-Y)
+     Map coordinates through a transform, or scale and translate
+     them, as they are converted.
+
+   #:relative BOOL
+     The points of the data are relative to the point before.
+
+   #:mode MODE
+     Send points in coordinate mode MODE. */
+static void parse_draw_options (SCM options, int type, draw_options_t *opts, const char *func)
+#define FUNC_NAME func
+{
+  opts->boundsp    = 0;
+  opts->decimate   = 0;
+  opts->tolerance  = 0;
+  opts->transformp = 0;
+  opts->relative   = 0;
+  opts->mode       = CoordModeOrigin;
+
+  while (!scm_is_null (options))
+    {
+      SCM key, val;
+
+      if (!scm_is_pair (options) || !scm_is_pair (SCM_CDR (options)))
+        scm_misc_error (func,
+                        "Drawing options must be keyword/value pairs: ~S",
+                        scm_list_1 (options));
+
+      key = SCM_CAR (options);
+      val = SCM_CADR (options);
+
+      if (scm_is_eq (key, kw_bounds))
+        {
+          int x, y, width, height;
+
+          if (!scm_is_vector (val) || (scm_c_vector_length (val) != 4))
+            scm_misc_error (func,
+                            "Bounds must be a vector #(x y width height): ~S",
+                            scm_list_1 (val));
+          x      = scm_to_short (scm_c_vector_ref (val, 0));
+          y      = scm_to_short (scm_c_vector_ref (val, 1));
+          width  = scm_to_ushort (scm_c_vector_ref (val, 2));
+          height = scm_to_ushort (scm_c_vector_ref (val, 3));
+
+          opts->boundsp = 1;
+          opts->xmin    = x;
+          opts->ymin    = y;
+          opts->xmax    = x + width - 1;
+          opts->ymax    = y + height - 1;
+        }
+      else if (scm_is_eq (key, kw_decimate) || scm_is_eq (key, kw_simplify))
+        {
+          if (type != XDATA_LINES)
+            scm_misc_error (func,
+                            "Drawing option ~S only applies to polylines",
+                            scm_list_1 (key));
+
+          if (scm_is_eq (key, kw_decimate))
+            opts->decimate = scm_is_true (val);
+          else
+            {
+              opts->tolerance = scm_to_double (val);
+              if (!(opts->tolerance >= 0))
+                scm_out_of_range (func, val);
+            }
+        }
+      else if (scm_is_eq (key, kw_relative) || scm_is_eq (key, kw_mode))
+        {
+          if ((type != XDATA_LINES) && (type != XDATA_POINTS) &&
+              (type != XDATA_FILL_POLYGON))
+            scm_misc_error (func,
+                            "Drawing option ~S only applies to points, polylines and polygons",
+                            scm_list_1 (key));
+
+          if (scm_is_eq (key, kw_relative))
+            opts->relative = scm_is_true (val);
+          else
+            {
+              opts->mode = scm_to_int (val);
+              if ((opts->mode != CoordModeOrigin) &&
+                  (opts->mode != CoordModePrevious))
+                scm_out_of_range (func, val);
+            }
+        }
+      else if (scm_is_eq (key, kw_transform) &&
+               SCM_NIMP (val) && (SCM_TYP16 (val) == scm_tc16_xtransform))
+        {
+          opts->transformp = 1;
+          opts->transform = *XTRANSFORM (val);
+        }
+      else if (scm_is_eq (key, kw_transform))
+        {
+          xform_t *t = &opts->transform;
+
+          if (!scm_is_vector (val) || (scm_c_vector_length (val) != 4))
+            scm_misc_error (func,
+                            "Transform must be a vector #(scale-x scale-y translate-x translate-y): ~S",
+                            scm_list_1 (val));
+
+          opts->transformp = 1;
+          t->xx = scm_to_double (scm_c_vector_ref (val, 0));
+          t->yy = scm_to_double (scm_c_vector_ref (val, 1));
+          t->x0 = scm_to_double (scm_c_vector_ref (val, 2));
+          t->y0 = scm_to_double (scm_c_vector_ref (val, 3));
+          t->xy = t->yx = 0;
+        }
+      else
+        scm_misc_error (func,
+                        "Unknown drawing option ~S",
+                        scm_list_1 (key));
+
+      options = SCM_CDDR (options);
+    }
+}
+#undef FUNC_NAME
+
+/* CULLING */
+
+/* Cohen-Sutherland outcodes: where a point lies relative to the
+   culling rectangle. */
+#define OUT_LEFT   1
+#define OUT_RIGHT  2
+#define OUT_BOTTOM 4
+#define OUT_TOP    8
+
+#define OUTCODE(o, x, y)                        \
+  (((x) < (o)->xmin)                            \
+   | (((x) > (o)->xmax) << 1)                   \
+   | (((y) > (o)->ymax) << 2)                   \
+   | (((y) < (o)->ymin) << 3))
+
+/* The outcode passes below are branch-free loops over the data, which
+   the compiler can vectorize; the clipping itself is only done for
+   the few data that cross the edge of the rectangle. */
+
+static void point_outcodes (const XPoint *pts, int n, const draw_options_t *o, unsigned char *codes)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    codes[i] = OUTCODE (o, pts[i].x, pts[i].y);
+}
+
+static void segment_outcodes (const XSegment *segs, int n, const draw_options_t *o, unsigned char *codes)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    codes[i] = (OUTCODE (o, segs[i].x1, segs[i].y1)
+                | (OUTCODE (o, segs[i].x2, segs[i].y2) << 4));
+}
+
+/* Return A * B / C, rounded to the nearest integer. */
+static int muldiv_round (int a, int b, int c)
+{
+  long long num = (long long) a * b;
+
+  if ((num < 0) != (c < 0))
+    return (num - c / 2) / c;
+  else
+    return (num + c / 2) / c;
+}
+
+/* Return V limited to the range LO to HI. */
+static int clamp_int (int v, int lo, int hi)
+{
+  return (v < lo) ? lo : (v > hi) ? hi : v;
+}
+
+/* Return nonzero if the line through (X1, Y1) and (X2, Y2) passes
+   through or touches the culling rectangle, that is if its corners
+   are not all strictly on one side of it. */
+static int line_meets_rect (const draw_options_t *o, int x1, int y1, int x2, int y2)
+{
+  long long dx = x2 - x1, dy = y2 - y1;
+  int cx[4] = { o->xmin, o->xmax, o->xmin, o->xmax };
+  int cy[4] = { o->ymin, o->ymin, o->ymax, o->ymax };
+  int i, above = 0, below = 0;
+
+  for (i = 0; i < 4; i++)
+    {
+      long long side = dx * (cy[i] - y1) - dy * (cx[i] - x1);
+
+      above |= (side >= 0);
+      below |= (side <= 0);
+    }
+
+  return above && below;
+}
+
+/* Move the end point (X1, Y1) of a line to (X2, Y2), with outcode C,
+   onto the edge of the culling rectangle where the line enters it,
+   storing the result in *X and *Y.  The line must meet the rectangle.
+   The coordinate worked out along the edge is clamped to it, so that
+   rounding can't leave the point outside. */
+static void clip_end (const draw_options_t *o,
+                      int x1, int y1,
+                      int x2, int y2,
+                      int c,
+                      int *x, int *y)
+{
+  int ex, ey;
+
+  /* Outside a corner, the line enters through the horizontal edge if
+     it meets it within the rectangle, and otherwise the vertical one. */
+  if (c & (OUT_TOP | OUT_BOTTOM))
+    {
+      ey = (c & OUT_TOP) ? o->ymin : o->ymax;
+      ex = x1 + muldiv_round (x2 - x1, ey - y1, y2 - y1);
+      if (!(c & (OUT_LEFT | OUT_RIGHT)) || ((ex >= o->xmin) && (ex <= o->xmax)))
+        {
+          *x = clamp_int (ex, o->xmin, o->xmax);
+          *y = ey;
+          return;
+        }
+    }
+
+  ex = (c & OUT_LEFT) ? o->xmin : o->xmax;
+  ey = y1 + muldiv_round (y2 - y1, ex - x1, x2 - x1);
+  *x = ex;
+  *y = clamp_int (ey, o->ymin, o->ymax);
+}
+
+/* Clip the line from (X1, Y1) to (X2, Y2), whose end points have
+   outcodes C1 and C2, to the culling rectangle.  Return zero if no
+   part of the line is inside it.  Whether it is is decided exactly,
+   before any rounding, and each end point is clipped only once. */
+static int clip_segment (const draw_options_t *o,
+                         int *x1, int *y1,
+                         int *x2, int *y2,
+                         int c1, int c2)
+{
+  int nx1 = *x1, ny1 = *y1, nx2 = *x2, ny2 = *y2;
+
+  if (!(c1 | c2))
+    return 1;
+  if (c1 & c2)
+    return 0;
+
+  /* The end points are not both beyond any one edge, so the line
+     misses the rectangle only if it passes by a corner. */
+  if (!line_meets_rect (o, *x1, *y1, *x2, *y2))
+    return 0;
+
+  if (c1)
+    clip_end (o, *x1, *y1, *x2, *y2, c1, &nx1, &ny1);
+  if (c2)
+    clip_end (o, *x2, *y2, *x1, *y1, c2, &nx2, &ny2);
+
+  *x1 = nx1;
+  *y1 = ny1;
+  *x2 = nx2;
+  *y2 = ny2;
+
+  return 1;
+}
+
+/* Return a buffer for NUM_DATA data of type TYPE, into which the data
+   of XD are filtered.  That is XD's own data if they are a copy, as
+   filtering never writes ahead of where it reads. */
+static void * filter_buffer (xdata_t *xd, int type, int num_data, const char *func)
+{
+  if (xd->allocated)
+    return xd->data;
+
+  return scratch_alloc (xd->dsp, num_data * datum_size[type], func);
+}
+
+/* Make the NUM_DATA data at DATA, of which ALLOCATED bytes were
+   allocated, the data of XD. */
+static void set_data (xdata_t *xd, void *data, size_t allocated, int num_data, const char *func)
+{
+  if (data != xd->data)
+    xd->allocated = allocated;
+  xd->data = data;
+  xd->count = num_data;
+}
+
+static void cull_points (xdata_t *xd, const draw_options_t *o, const char *func)
+{
+  XPoint *pts = xd->data;
+  XPoint *out = filter_buffer (xd, XDATA_POINTS, xd->count, func);
+  int i, n = 0;
+
+  for (i = 0; i < xd->count; i++)
+    if (!OUTCODE (o, pts[i].x, pts[i].y))
+      out[n++] = pts[i];
+
+  set_data (xd, out, xd->count * sizeof (XPoint), n, func);
+}
+
+static void clip_segments (xdata_t *xd, const draw_options_t *o, const char *func)
+{
+  XSegment *segs = xd->data;
+  XSegment *out;
+  unsigned char *codes;
+  int i, n = 0;
+
+  codes = scratch_alloc (xd->dsp, xd->count, func);
+  segment_outcodes (segs, xd->count, o, codes);
+
+  out = filter_buffer (xd, XDATA_SEGMENTS, xd->count, func);
+
+  for (i = 0; i < xd->count; i++)
+    {
+      int c1 = codes[i] & 0xf, c2 = codes[i] >> 4;
+      int x1, y1, x2, y2;
+
+      if (!(c1 | c2))
+        {
+          out[n++] = segs[i];
+          continue;
+        }
+      if (c1 & c2)
+        continue;
+
+      x1 = segs[i].x1;
+      y1 = segs[i].y1;
+      x2 = segs[i].x2;
+      y2 = segs[i].y2;
+      if (clip_segment (o, &x1, &y1, &x2, &y2, c1, c2))
+        {
+          out[n].x1 = x1;
+          out[n].y1 = y1;
+          out[n].x2 = x2;
+          out[n].y2 = y2;
+          n++;
+        }
+    }
+
+  set_data (xd, out, xd->count * sizeof (XSegment), n, func);
+}
+
+/* Clip a polyline.  The parts of it inside the culling rectangle
+   become separate runs, whose ends are clipped to the rectangle. */
+static void clip_lines (xdata_t *xd, const draw_options_t *o, const char *func)
+{
+  XPoint *pts = xd->data;
+  XPoint *out;
+  unsigned char *codes;
+  int *runs;
+  int count = xd->count;
+  int i, n = 0, num_runs = 0, run_start = 0, open = 0;
+
+  if (count < 2)
+    return;
+
+  codes = scratch_alloc (xd->dsp, count, func);
+  point_outcodes (pts, count, o, codes);
+
+  /* Each line adds at most two points, and at most one run. */
+  out  = scratch_alloc (xd->dsp, 2 * (count - 1) * sizeof (XPoint), func);
+  runs = scratch_alloc (xd->dsp, (count - 1) * sizeof (int), func);
+
+#define CLOSE_RUN()                             \
+  do                                            \
+    {                                           \
+      if (open)                                 \
+        runs[num_runs++] = n - run_start;       \
+      open = 0;                                 \
+    }                                           \
+  while (0)
+
+  for (i = 0; i < count - 1; i++)
+    {
+      int c1 = codes[i], c2 = codes[i + 1];
+      int x1 = pts[i].x, y1 = pts[i].y;
+      int x2 = pts[i + 1].x, y2 = pts[i + 1].y;
+
+      if ((c1 & c2) || ((c1 | c2) && !clip_segment (o, &x1, &y1, &x2, &y2, c1, c2)))
+        {
+          CLOSE_RUN ();
+          continue;
+        }
+
+      /* A line continues the current run unless its start was
+         clipped; the end of the previous line is then the same
+         point. */
+      if (!open || c1)
+        {
+          CLOSE_RUN ();
+          run_start = n;
+          out[n].x = x1;
+          out[n].y = y1;
+          n++;
+          open = 1;
+        }
+
+      out[n].x = x2;
+      out[n].y = y2;
+      n++;
+
+      if (c2)
+        CLOSE_RUN ();
+    }
+  CLOSE_RUN ();
+#undef CLOSE_RUN
+
+  /* set_data sees OUT as new data, and takes ownership of it. */
+  set_data (xd, out, 2 * (count - 1) * sizeof (XPoint), n, func);
+  xd->runs = runs;
+  xd->num_runs = num_runs;
+}
+
+/* Cull rectangles, or arcs, whose bounding box is outside the culling
+   rectangle. */
+static void cull_boxes (xdata_t *xd, int type, const draw_options_t *o, const char *func)
+{
+  char *in = xd->data;
+  char *out = filter_buffer (xd, type, xd->count, func);
+  int size = datum_size[type];
+  int i, n = 0;
+
+  for (i = 0; i < xd->count; i++, in += size)
+    {
+      /* XRectangle and XArc both start with x, y, width, height. */
+      int x, y, width, height;
+
+      if ((type == XDATA_ARCS) || (type == XDATA_FILL_ARCS))
+        {
+          x      = ((XArc *) in)->x;
+          y      = ((XArc *) in)->y;
+          width  = ((XArc *) in)->width;
+          height = ((XArc *) in)->height;
+        }
+      else
+        {
+          x      = ((XRectangle *) in)->x;
+          y      = ((XRectangle *) in)->y;
+          width  = ((XRectangle *) in)->width;
+          height = ((XRectangle *) in)->height;
+        }
+
+      /* An outline is WIDTH + 1 pixels wide, so test inclusively. */
+      if ((x <= o->xmax) && (x + width >= o->xmin) &&
+          (y <= o->ymax) && (y + height >= o->ymin))
+        {
+          if (out + n * size != in)
+            memcpy (out + n * size, in, size);
+          n++;
+        }
+    }
+
+  set_data (xd, out, xd->count * size, n, func);
+}
+
+/* Drop the data of XD, of type TYPE, that are outside the culling
+   rectangle of OPTS, and clip the lines that cross its edges. */
+static void cull_data (xdata_t *xd, int type, const draw_options_t *opts, const char *func)
+{
+  switch (type)
+    {
+    case XDATA_POINTS:
+      cull_points (xd, opts, func);
+      break;
+
+    case XDATA_SEGMENTS:
+      clip_segments (xd, opts, func);
+      break;
+
+    case XDATA_LINES:
+      clip_lines (xd, opts, func);
+      break;
+
+    case XDATA_ARCS:
+    case XDATA_RECTANGLES:
+    case XDATA_FILL_ARCS:
+    case XDATA_FILL_RECTANGLES:
+      cull_boxes (xd, type, opts, func);
+      break;
+
+    case XDATA_FILL_POLYGON:
+      {
+        /* A polygon is only culled as a whole, when all its vertices
+           are on the far side of one edge of the rectangle. */
+        XPoint *pts = xd->data;
+        int i, c = OUT_LEFT | OUT_RIGHT | OUT_BOTTOM | OUT_TOP;
+
+        for (i = 0; (i < xd->count) && c; i++)
+          c &= OUTCODE (opts, pts[i].x, pts[i].y);
+        if (c)
+          xd->count = 0;
+      }
+      break;
+
+    default:
+      scm_misc_error (func,
                       "Internal X data type error (~S)",
                       scm_list_1 (scm_from_int (type)));
     }
+}
+
+/* LEVEL OF DETAIL */
+
+/* Reduce a polyline to the first, lowest, highest and last points of
+   each run of consecutive points in the same pixel column, keeping
+   their order.  Drawn as lines, the result covers the same pixels
+   as the original, which for a densely sampled series may have many
+   times more points than there are columns. */
+static void decimate_lines (xdata_t *xd, const char *func)
+{
+  XPoint *pts = xd->data;
+  XPoint *out;
+  int count = xd->count;
+  int i, j, n = 0;
+
+  if (count < 3)
+    return;
+
+  out = filter_buffer (xd, XDATA_LINES, count, func);
+
+  for (i = 0; i < count; i = j)
+    {
+      int lo = i, hi = i;
+      XPoint keep[4];
+      int idx[4];
+      int k, m = 0;
+
+      for (j = i + 1; (j < count) && (pts[j].x == pts[i].x); j++)
+        {
+          if (pts[j].y < pts[lo].y)
+            lo = j;
+          if (pts[j].y > pts[hi].y)
+            hi = j;
+        }
+
+      /* Collect the points to keep, in order and without repeats,
+         before writing anything: OUT may overlap the column. */
+      idx[m++] = i;
+      if (lo < hi)
+        {
+          idx[m++] = lo;
+          idx[m++] = hi;
+        }
+      else
+        {
+          idx[m++] = hi;
+          idx[m++] = lo;
+        }
+      idx[m++] = j - 1;
+
+      for (k = 0; k < m; k++)
+        keep[k] = pts[idx[k]];
+      for (k = 0; k < m; k++)
+        if ((k == 0) || (idx[k] != idx[k - 1]))
+          out[n++] = keep[k];
+    }
+
+  set_data (xd, out, count * sizeof (XPoint), n, func);
+}
+
+/* Simplify a polyline with the Douglas-Peucker algorithm, dropping
+   points that are within TOLERANCE pixels of the line through the
+   points that are kept on either side of them.  The recursion of
+   the algorithm is replaced by an explicit stack, so that long
+   polylines cannot overflow the C stack. */
+static void simplify_lines (xdata_t *xd, double tolerance, const char *func)
+{
+  XPoint *pts = xd->data;
+  XPoint *out;
+  int count = xd->count;
+  unsigned char *keep;
+  int *stack;
+  int sp = 0;
+  int i, n = 0;
+
+  if (count < 3)
+    return;
+
+  keep  = scratch_alloc (xd->dsp, count, func);
+  stack = scratch_alloc (xd->dsp, 2 * count * sizeof (int), func);
+  memset (keep, 0, count);
+  keep[0] = keep[count - 1] = 1;
+
+  stack[sp++] = 0;
+  stack[sp++] = count - 1;
+
+  while (sp > 0)
+    {
+      int last  = stack[--sp];
+      int first = stack[--sp];
+      double dx = pts[last].x - pts[first].x;
+      double dy = pts[last].y - pts[first].y;
+      double len2 = dx * dx + dy * dy;
+      double max_d2 = 0;
+      int max_i = 0;
+
+      /* Find the point furthest from the line from FIRST to LAST,
+         comparing squared distances scaled by LEN2. */
+      for (i = first + 1; i < last; i++)
+        {
+          double px = pts[i].x - pts[first].x;
+          double py = pts[i].y - pts[first].y;
+          double d2;
+
+          if (len2 > 0)
+            {
+              double cross = px * dy - py * dx;
+              d2 = cross * cross;
+            }
+          else
+            d2 = px * px + py * py;
+
+          if (d2 > max_d2)
+            {
+              max_d2 = d2;
+              max_i = i;
+            }
+        }
+
+      if (max_d2 > tolerance * tolerance * ((len2 > 0) ? len2 : 1))
+        {
+          keep[max_i] = 1;
+          if (max_i - first > 1)
+            {
+              stack[sp++] = first;
+              stack[sp++] = max_i;
+            }
+          if (last - max_i > 1)
+            {
+              stack[sp++] = max_i;
+              stack[sp++] = last;
+            }
+        }
+    }
+
+  out = filter_buffer (xd, XDATA_LINES, count, func);
+  for (i = 0; i < count; i++)
+    if (keep[i])
+      out[n++] = pts[i];
+
+  set_data (xd, out, count * sizeof (XPoint), n, func);
+}
+
+/* Make sure that the data of XD are a private copy, which may be
+   modified. */
+static void private_data (xdata_t *xd, int type, const char *func)
+{
+  void *copy;
+
+  if (xd->allocated)
+    return;
+
+  copy = scratch_alloc (xd->dsp, xd->count * datum_size[type], func);
+  memcpy (copy, xd->data, xd->count * datum_size[type]);
+  set_data (xd, copy, xd->count * datum_size[type], xd->count, func);
+}
+
+/* Make the N points at PTS, each of which but the first is relative
+   to the point before, absolute. */
+static void absolute_points (XPoint *pts, int n)
+{
+  int i;
+
+  for (i = 1; i < n; i++)
+    {
+      pts[i].x = add_saturate (pts[i - 1].x, pts[i].x);
+      pts[i].y = add_saturate (pts[i - 1].y, pts[i].y);
+    }
+}
+
+/* The reverse: make each of the N absolute points at PTS but the
+   first relative to the point before. */
+static void relative_points (XPoint *pts, int n)
+{
+  int i;
+
+  for (i = n - 1; i > 0; i--)
+    {
+      pts[i].x = sub_saturate (pts[i].x, pts[i - 1].x);
+      pts[i].y = sub_saturate (pts[i].y, pts[i - 1].y);
+    }
+}
+
+/* Draw DATA, of type TYPE, on WINDOW using GC.  SHAPE is only used
+   for XDATA_FILL_POLYGON, and OPTIONS are the keyword arguments
+   handled by parse_draw_options.  If WINDOW is a display list, the
+   drawing is recorded instead. */
+static SCM draw (SCM window, SCM gc, SCM data, int type, int shape, SCM options, const char *func)
+{
+  xdisplay_t *dsp = NULL;
+  xwindow_t *win = NULL;
+  xdlist_t *dl = NULL;
+  xgc_t *gc1;
+  int gc_index = 0;
+
+  if (SCM_NIMP (window) && (SCM_TYP16 (window) == scm_tc16_xdlist))
+    {
+      SCM display = valid_dsp (gc, SCM_ARG2, XDISPLAY_STATE_OPEN, func);
+
+      /* Recording, the GC's display lends its scratch arena. */
+      dl = XDLIST (window);
+      dsp = XDISPLAY (display);
+      gc1 = valid_gc (gc, SCM_ARG2, ~XGC_STATE_FREED, func);
+      gc_index = dlist_object (dl, gc, display, func);
+    }
+  else
+    {
+      dsp = XDISPLAY (valid_dsp (window, SCM_ARG1, XDISPLAY_STATE_OPEN, func));
+      win = valid_win (window, SCM_ARG1, ~XWINDOW_STATE_DESTROYED, func);
+      gc1 = valid_gc (gc, SCM_ARG2, ~XGC_STATE_FREED, func);
+    }
+
+  return draw_valid (dsp, win, dl, gc1, gc_index, data, type, shape, options, func);
+}
+
+/* The same, once the drawable, or display list DL, and the GC have
+   been validated.  Drawing on WIN, DSP is its display; recording in
+   DL, it is the display of GC1, whose index in DL is GC_INDEX. */
+static SCM draw_valid (xdisplay_t *dsp,
+                       xwindow_t *win,
+                       xdlist_t *dl,
+                       xgc_t *gc1,
+                       int gc_index,
+                       SCM data,
+                       int type,
+                       int shape,
+                       SCM options,
+                       const char *func)
+{
+  draw_options_t opts;
+  const xform_t *xform = NULL;
+  xdata_t xd;
+  char *p;
+  int i, num_runs, relative;
+
+  parse_draw_options (options, type, &opts, func);
+  if (!opts.transformp && scm_is_true (gc1->transform))
+    {
+      opts.transformp = 1;
+      opts.transform = *XTRANSFORM (gc1->transform);
+    }
+
+  if (opts.transformp)
+    xform = &opts.transform;
+
+  scratch_reset (dsp, func);
+  valid_data_scratch (data, SCM_ARG3, type, xform, opts.relative, NULL, 0,
+                      dsp, &xd, func);
+  relative = opts.relative;
+
+  /* Level of detail and culling work on absolute points. */
+  if (relative && (opts.decimate || (opts.tolerance > 0) || opts.boundsp))
+    {
+      private_data (&xd, type, func);
+      absolute_points (xd.data, xd.count);
+      relative = 0;
+    }
+
+  if (opts.decimate)
+    decimate_lines (&xd, func);
+  if (opts.tolerance > 0)
+    simplify_lines (&xd, opts.tolerance, func);
+  if (opts.boundsp)
+    cull_data (&xd, type, &opts, func);
+
+  num_runs = xd.runs ? xd.num_runs : 1;
+
+  if (!relative && (opts.mode == CoordModePrevious))
+    {
+      private_data (&xd, type, func);
+      for (i = 0, p = xd.data; i < num_runs; i++)
+        {
+          int n = xd.runs ? xd.runs[i] : xd.count;
+
+          relative_points ((XPoint *) p, n);
+          p += n * sizeof (XPoint);
+        }
+      relative = 1;
+    }
+
+  p = xd.data;
+  for (i = 0; i < num_runs; i++)
+    {
+      int n = xd.runs ? xd.runs[i] : xd.count;
+      int mode = relative ? CoordModePrevious : CoordModeOrigin;
+
+      if (n > 0)
+        {
+          if (dl)
+            record_data (dl, gc_index, type, p, n, shape, mode, func);
+          else
+            draw_data (dsp, win->win, gc1->gc, type, p, n, shape, mode, func);
+        }
+      p += n * datum_size[type];
+    }
+
+  release_data (&xd, func);
+
+  return SCM_UNSPECIFIED;
+}
+
+SCM_DEFINE (scm_x_draw_arcs_x, "x-draw-arcs!", 3, 0, 1,
+            (SCM window,
+             SCM gc,
+             SCM arcs,
+             SCM options),
+            "Draws a set of arcs on the specified @var{window}\n"
+            "using the specified graphics context @var{gc}.\n"
+            "@var{arcs} should be a uniform numeric array\n"
+            "(@code{s16}, @code{s32}, @code{f32} or @code{f64})\n"
+            "with dimensions N x 6, where N is the number of arcs,\n"
+            "or a bytevector holding N packed XArc structures.\n"
+            "The 6 elements that specify each arc are, in order,\n"
+            "X, Y, WIDTH, HEIGHT, ANGLE1 and ANGLE2.\n"
+            "@var{options} are as for @code{x-draw-lines!}.")
+#define FUNC_NAME s_scm_x_draw_arcs_x
+{
+  return draw (window, gc, arcs, XDATA_ARCS, Complex, options, FUNC_NAME);
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_draw_lines_x, "x-draw-lines!", 3, 0, 1,
+            (SCM window,
+             SCM gc,
+             SCM points,
+             SCM options),
+            "Draws a set of lines on the specified @var{window}\n"
+            "using the specified graphics context @var{gc}.\n"
+            "@var{points} should be a uniform numeric array\n"
+            "(@code{s16}, @code{s32}, @code{f32} or @code{f64})\n"
+            "with dimensions N x 2, where N is the number of points,\n"
+            "or a bytevector holding N packed XPoint structures.\n"
+            "Values are rounded to the nearest integer, and clamped to\n"
+            "the range of the X protocol's 16-bit coordinates.\n"
+            "\n"
+            "@var{options} are keyword arguments, shared by all the\n"
+            "drawing primitives:\n"
+            "\n"
+            "@table @code\n"
+            "@item #:bounds #(X Y WIDTH HEIGHT)\n"
+            "Drop the data that lie wholly outside the given rectangle\n"
+            "before they are sent to the server, and clip lines and\n"
+            "segments that cross its edges.  A polyline that leaves and\n"
+            "re-enters the rectangle is drawn as several polylines.  The\n"
+            "rectangle would usually be the visible part of the\n"
+            "drawable, widened by half the line width.\n"
+            "\n"
+            "@item #:decimate BOOL\n"
+            "If true, reduce the polyline to the first, lowest, highest\n"
+            "and last points of each run of points in the same pixel\n"
+            "column.  This draws the same pixels as the full polyline,\n"
+            "and suits series sampled more densely than the screen.\n"
+            "\n"
+            "@item #:simplify TOLERANCE\n"
+            "Simplify the polyline with the Douglas-Peucker algorithm,\n"
+            "leaving out points that are less than @var{tolerance}\n"
+            "pixels from the simplified line.\n"
+            "\n"
+            "@item #:transform TRANSFORM\n"
+            "Map each point of the data through @var{transform}, made\n"
+            "by @code{x-make-transform}, as it is converted.  Without\n"
+            "this option, the transform attached to @var{gc} by\n"
+            "@code{x-set-gc-transform!}, if any, is used.\n"
+            "\n"
+            "@item #:transform #(SCALE-X SCALE-Y TRANSLATE-X TRANSLATE-Y)\n"
+            "Map each point (X, Y) of the data to\n"
+            "(SCALE-X * X + TRANSLATE-X, SCALE-Y * Y + TRANSLATE-Y)\n"
+            "as it is converted.  Widths and heights are scaled, and\n"
+            "rectangles and arcs that are flipped by a negative scale\n"
+            "are drawn where they appear after the flip.  They cannot\n"
+            "be rotated.\n"
+            "\n"
+            "@item #:relative BOOL\n"
+            "If true, each point of the data but the first is relative\n"
+            "to the point before, as in Xlib's CoordModePrevious.  Such\n"
+            "data are sent with CoordModePrevious.  Transformed or\n"
+            "floating point data are summed into absolute points before\n"
+            "they are mapped and rounded, so that rounding errors do\n"
+            "not build up along the path.\n"
+            "\n"
+            "@item #:mode MODE\n"
+            "If @var{mode} is CoordModePrevious, absolute points are\n"
+            "delta-encoded and sent with CoordModePrevious.\n"
+            "@end table\n"
+            "\n"
+            "@code{#:decimate} and @code{#:simplify} only apply to\n"
+            "@code{x-draw-lines!}.  They are applied, in that order,\n"
+            "before @code{#:bounds}.  @code{#:relative} and\n"
+            "@code{#:mode} only apply to @code{x-draw-lines!},\n"
+            "@code{x-draw-points!} and @code{x-fill-polygon!}.")
+#define FUNC_NAME s_scm_x_draw_lines_x
+{
+  return draw (window, gc, points, XDATA_LINES, Complex, options, FUNC_NAME);
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_draw_points_x, "x-draw-points!", 3, 0, 1,
+            (SCM window,
+             SCM gc,
+             SCM points,
+             SCM options),
+            "Draws a set of points on the specified @var{window}\n"
+            "using the specified graphics context @var{gc}.\n"
+            "@var{points} should be a uniform numeric array\n"
+            "(@code{s16}, @code{s32}, @code{f32} or @code{f64})\n"
+            "with dimensions N x 2, where N is the number of points,\n"
+            "or a bytevector holding N packed XPoint structures.\n"
+            "@var{options} are as for @code{x-draw-lines!}.")
+#define FUNC_NAME s_scm_x_draw_points_x
+{
+  return draw (window, gc, points, XDATA_POINTS, Complex, options, FUNC_NAME);
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_draw_segments_x, "x-draw-segments!", 3, 0, 1,
+            (SCM window,
+             SCM gc,
+             SCM segments,
+             SCM options),
+            "Draws a set of line segments on the specified @var{window}\n"
+            "using the specified graphics context @var{gc}.\n"
+            "@var{segments} should be a uniform numeric array\n"
+            "(@code{s16}, @code{s32}, @code{f32} or @code{f64})\n"
+            "with dimensions N x 4, where N is the number of segments,\n"
+            "or a bytevector holding N packed XSegment structures.\n"
+            "The 4 elements that specify each line segment are, in order,\n"
+            "X1, Y1, X2, Y2.\n"
+            "@var{options} are as for @code{x-draw-lines!}.")
+#define FUNC_NAME s_scm_x_draw_segments_x
+{
+  return draw (window, gc, segments, XDATA_SEGMENTS, Complex, options, FUNC_NAME);
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_draw_rectangles_x, "x-draw-rectangles!", 3, 0, 1,
+            (SCM window,
+             SCM gc,
+             SCM rectangles,
+             SCM options),
+            "Draws a set of rectangles on the specified @var{window}\n"
+            "using the specified graphics context @var{gc}.\n"
+            "@var{rectangles} should be a uniform numeric array\n"
+            "(@code{s16}, @code{s32}, @code{f32} or @code{f64})\n"
+            "with dimensions N x 4, where N is the number of rectangles,\n"
+            "or a bytevector holding N packed XRectangle structures.\n"
+            "The 4 elements that specify each rectangle are, in order,\n"
+            "X1, Y1, WIDTH, HEIGHT.\n"
+            "@var{options} are as for @code{x-draw-lines!}.")
+#define FUNC_NAME s_scm_x_draw_rectangles_x
+{
+  return draw (window, gc, rectangles, XDATA_RECTANGLES, Complex, options, FUNC_NAME);
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_fill_arcs_x, "x-fill-arcs!", 3, 0, 1,
+            (SCM window,
+             SCM gc,
+             SCM arcs,
+             SCM options),
+            "Fills a set of arcs on the specified @var{window}\n"
+            "using the specified graphics context @var{gc}.\n"
+            "Each arc is filled as a chord or a pie slice, according\n"
+            "to the arc mode of @var{gc}.  @var{arcs} is as for\n"
+            "@code{x-draw-arcs!}.\n"
+            "@var{options} are as for @code{x-draw-lines!}.")
+#define FUNC_NAME s_scm_x_fill_arcs_x
+{
+  return draw (window, gc, arcs, XDATA_FILL_ARCS, Complex, options, FUNC_NAME);
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_fill_polygon_x, "x-fill-polygon!", 3, 1, 1,
+            (SCM window,
+             SCM gc,
+             SCM points,
+             SCM shape,
+             SCM options),
+            "Fills the polygon whose vertices are @var{points} on the\n"
+            "specified @var{window} using the specified graphics context\n"
+            "@var{gc}.  @var{points} is as for @code{x-draw-lines!}.\n"
+            "@var{shape} is one of Complex, Nonconvex or Convex, and\n"
+            "lets the server choose a faster fill algorithm when the\n"
+            "polygon is known to be simpler than Complex.  If @var{shape}\n"
+            "is omitted, Complex is assumed.\n"
+            "@var{options} are as for @code{x-draw-lines!}.")
+#define FUNC_NAME s_scm_x_fill_polygon_x
+{
+  int shape1;
+
+  /* The shape may be left out before keyword options. */
+  if (scm_is_keyword (shape))
+    {
+      options = scm_cons (shape, options);
+      shape = SCM_UNDEFINED;
+    }
+
+  if (!SCM_UNBNDP (shape))
+    {
+      SCM_VALIDATE_INT_COPY (SCM_ARG4, shape, shape1);
+      SCM_ASSERT_RANGE (SCM_ARG4,
+                        shape,
+                        (shape1 >= Complex) && (shape1 <= Convex));
+    }
+  else
+    shape1 = Complex;
+
+  return draw (window, gc, points, XDATA_FILL_POLYGON, shape1, options, FUNC_NAME);
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_fill_rectangles_x, "x-fill-rectangles!", 3, 0, 1,
+            (SCM window,
+             SCM gc,
+             SCM rectangles,
+             SCM options),
+            "Fills a set of rectangles on the specified @var{window}\n"
+            "using the specified graphics context @var{gc}.\n"
+            "@var{rectangles} is as for @code{x-draw-rectangles!}.\n"
+            "@var{options} are as for @code{x-draw-lines!}.")
+#define FUNC_NAME s_scm_x_fill_rectangles_x
+{
+  return draw (window, gc, rectangles, XDATA_FILL_RECTANGLES, Complex, options, FUNC_NAME);
+}
+#undef FUNC_NAME
+
+
+/* BATCHES */
+
+/* x-draw-batch! takes a list of drawings, each with its own GC and
+   primitive type, and sends them as few requests as it can.  It moves
+   each drawing back to join the last earlier drawing with the same GC
+   and type, provided that no drawing it would then be drawn before
+   overlaps it, so that the result looks as if the drawings had been
+   made in order.  The data of each group that can be concatenated are
+   then drawn together. */
+
+SCM_SYMBOL (sym_arcs, "arcs");
+SCM_SYMBOL (sym_lines, "lines");
+SCM_SYMBOL (sym_points, "points");
+SCM_SYMBOL (sym_segments, "segments");
+SCM_SYMBOL (sym_rectangles, "rectangles");
+SCM_SYMBOL (sym_fill_arcs, "fill-arcs");
+SCM_SYMBOL (sym_fill_polygon, "fill-polygon");
+SCM_SYMBOL (sym_fill_rectangles, "fill-rectangles");
+
+/* Return the XDATA_* type named by SYM. */
+static int batch_type (SCM sym, const char *func)
+{
+  if (scm_is_eq (sym, sym_arcs))
+    return XDATA_ARCS;
+  if (scm_is_eq (sym, sym_lines))
+    return XDATA_LINES;
+  if (scm_is_eq (sym, sym_points))
+    return XDATA_POINTS;
+  if (scm_is_eq (sym, sym_segments))
+    return XDATA_SEGMENTS;
+  if (scm_is_eq (sym, sym_rectangles))
+    return XDATA_RECTANGLES;
+  if (scm_is_eq (sym, sym_fill_arcs))
+    return XDATA_FILL_ARCS;
+  if (scm_is_eq (sym, sym_fill_polygon))
+    return XDATA_FILL_POLYGON;
+  if (scm_is_eq (sym, sym_fill_rectangles))
+    return XDATA_FILL_RECTANGLES;
+
+  scm_misc_error (func, "Unknown primitive type ~S", scm_list_1 (sym));
+  return -1;
+}
+
+/* Extend BBOX to cover X0..X1, Y0..Y1. */
+static void extend_bbox (int *bbox, int x0, int y0, int x1, int y1)
+{
+  if (x0 < bbox[0])
+    bbox[0] = x0;
+  if (y0 < bbox[1])
+    bbox[1] = y0;
+  if (x1 > bbox[2])
+    bbox[2] = x1;
+  if (y1 > bbox[3])
+    bbox[3] = y1;
+}
+
+/* Work out the bounding box of ITEM, which has at least one datum. */
+static void batch_bbox (batch_item_t *item)
+{
+  xgc_t *gc1 = (xgc_t *) SCM_SMOB_DATA (item->gc);
+  short *d = item->xd.data;
+  int k = shorts_per_datum[item->type];
+  int i, pad;
+
+  item->bbox[0] = item->bbox[1] = INT_MAX;
+  item->bbox[2] = item->bbox[3] = INT_MIN;
+
+  for (i = 0; i < item->xd.count; i++, d += k)
+    {
+      int x0 = d[0], y0 = d[1], x1 = d[0], y1 = d[1];
+
+      switch (item->type)
+        {
+        case XDATA_SEGMENTS:
+          extend_bbox (item->bbox, d[2], d[3], d[2], d[3]);
+          break;
+
+        case XDATA_ARCS:
+        case XDATA_RECTANGLES:
+        case XDATA_FILL_ARCS:
+        case XDATA_FILL_RECTANGLES:
+          x1 = d[0] + ((unsigned short *) d)[2];
+          y1 = d[1] + ((unsigned short *) d)[3];
+          break;
+        }
+
+      extend_bbox (item->bbox, x0, y0, x1, y1);
+    }
+
+  /* Outlines reach beyond their coordinates by up to half the line
+     width, or further at miter joins, which X cuts off only below 11
+     degrees, where they are about 5.2 line widths long.  Filled
+     shapes and points reach one pixel beyond.  If the line width is
+     unknown, assume that the drawing may touch anything. */
+  switch (item->type)
+    {
+    case XDATA_POINTS:
+    case XDATA_FILL_ARCS:
+    case XDATA_FILL_POLYGON:
+    case XDATA_FILL_RECTANGLES:
+      pad = 1;
+      break;
+
+    default:
+      if (gc1->known & GCLineWidth)
+        pad = 6 * gc1->values.line_width + 1;
+      else
+        pad = INT_MAX / 4;
+      break;
+    }
+
+  item->bbox[0] -= pad;
+  item->bbox[1] -= pad;
+  item->bbox[2] += pad;
+  item->bbox[3] += pad;
+}
+
+/* Return nonzero if bounding boxes A and B overlap. */
+static int bbox_overlap (const int *a, const int *b)
+{
+  return ((a[0] <= b[2]) && (b[0] <= a[2]) &&
+          (a[1] <= b[3]) && (b[1] <= a[3]));
+}
+
+SCM_DEFINE (scm_x_draw_batch_x, "x-draw-batch!", 2, 0, 0,
+            (SCM window,
+             SCM items),
+            "Draw @var{items} on @var{window}, which may be a display\n"
+            "list.  Each item is a list @code{(gc type data)}, where\n"
+            "@var{type} is one of the symbols @code{arcs}, @code{lines},\n"
+            "@code{points}, @code{segments}, @code{rectangles},\n"
+            "@code{fill-arcs}, @code{fill-polygon} or\n"
+            "@code{fill-rectangles}, and @var{data} are as for the\n"
+            "corresponding drawing primitive.  Each @var{gc}'s transform\n"
+            "applies to its data.\n"
+            "\n"
+            "Items with the same @var{gc} and @var{type} are grouped, and\n"
+            "the points, segments, rectangles and filled arcs of each\n"
+            "group are sent in as few requests as possible.  Arcs, lines\n"
+            "and polygons are never joined with those of another item.\n"
+            "An item is only moved ahead of items that it cannot\n"
+            "overlap, so the result is as if the items had been drawn in\n"
+            "order.")
+#define FUNC_NAME s_scm_x_draw_batch_x
+{
+  xdisplay_t *dsp = NULL;
+  xwindow_t *win = NULL;
+  xdlist_t *dl = NULL;
+  batch_item_t *item;
+  batch_group_t *group;
+  int num_items, num_groups = 0;
+  int i, j, g;
+  SCM l;
+
+  num_items = scm_ilength (items);
+  SCM_ASSERT (num_items >= 0, items, SCM_ARG2, FUNC_NAME);
+
+  if (SCM_NIMP (window) && (SCM_TYP16 (window) == scm_tc16_xdlist))
+    {
+      dl = XDLIST (window);
+      if (num_items == 0)
+        return SCM_UNSPECIFIED;
+
+      /* Recording, all the GCs must be on one display, which lends
+         its scratch arena. */
+      SCM_ASSERT (scm_ilength (SCM_CAR (items)) == 3, SCM_CAR (items), SCM_ARG2, FUNC_NAME);
+      dsp = XDISPLAY (valid_dsp (SCM_CAR (SCM_CAR (items)), SCM_ARG2, XDISPLAY_STATE_OPEN, FUNC_NAME));
+    }
+  else
+    {
+      dsp = XDISPLAY (valid_dsp (window, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
+      win = valid_win (window, SCM_ARG1, ~XWINDOW_STATE_DESTROYED, FUNC_NAME);
+      if (num_items == 0)
+        return SCM_UNSPECIFIED;
+    }
+
+  /* The items are kept in the scratch arena, which the collector does
+     not scan; what they refer to stays reachable from ITEMS. */
+  scratch_reset (dsp, FUNC_NAME);
+  item = scratch_alloc (dsp, num_items * sizeof (batch_item_t), FUNC_NAME);
+  group = scratch_alloc (dsp, num_items * sizeof (batch_group_t), FUNC_NAME);
+
+  /* Convert each item's data. */
+  for (i = 0, l = items; i < num_items; i++, l = SCM_CDR (l))
+    {
+      SCM it = SCM_CAR (l);
+      xgc_t *gc1;
+
+      SCM_ASSERT (scm_ilength (it) == 3, it, SCM_ARG2, FUNC_NAME);
+
+      item[i].gc = SCM_CAR (it);
+      gc1 = valid_gc (item[i].gc, SCM_ARG2, ~XGC_STATE_FREED, FUNC_NAME);
+      if (dl)
+        item[i].gc_index =
+          dlist_object (dl, item[i].gc,
+                        valid_dsp (item[i].gc, SCM_ARG2, XDISPLAY_STATE_OPEN, FUNC_NAME),
+                        FUNC_NAME);
+      else if (!scm_is_eq (gc1->dsp, win->dsp))
+        scm_misc_error (FUNC_NAME,
+                        "GC ~S is not on the display of ~S",
+                        scm_list_2 (item[i].gc, window));
+
+      item[i].type = batch_type (SCM_CADR (it), FUNC_NAME);
+      valid_data (SCM_CAR (SCM_CDDR (it)), SCM_ARG2, item[i].type,
+                  scm_is_true (gc1->transform) ? XTRANSFORM (gc1->transform) : NULL,
+                  dsp, &item[i].xd, FUNC_NAME);
+      item[i].next = -1;
+
+      if (item[i].xd.count > 0)
+        batch_bbox (&item[i]);
+    }
+
+  /* Group them. */
+  for (i = 0; i < num_items; i++)
+    {
+      /* PolyArc joins consecutive arcs that meet, so arcs from
+         separate items must not be sent in one request either. */
+      int concatenable = ((item[i].type != XDATA_LINES) &&
+                          (item[i].type != XDATA_ARCS) &&
+                          (item[i].type != XDATA_FILL_POLYGON));
+
+      if (item[i].xd.count == 0)
+        continue;
+
+      /* Find the last group this item could join, and check that it
+         does not overlap any group after it. */
+      g = -1;
+      if (concatenable)
+        for (j = num_groups - 1; j >= 0; j--)
+          {
+            batch_item_t *first = &item[group[j].first];
+
+            if (scm_is_eq (first->gc, item[i].gc) && (first->type == item[i].type))
+              {
+                g = j;
+                break;
+              }
+            if (bbox_overlap (group[j].bbox, item[i].bbox))
+              break;
+          }
+
+      if (g >= 0)
+        {
+          item[group[g].last].next = i;
+          group[g].last = i;
+          group[g].count += item[i].xd.count;
+          extend_bbox (group[g].bbox,
+                       item[i].bbox[0], item[i].bbox[1],
+                       item[i].bbox[2], item[i].bbox[3]);
+        }
+      else
+        {
+          g = num_groups++;
+          group[g].first = group[g].last = i;
+          group[g].count = item[i].xd.count;
+          memcpy (group[g].bbox, item[i].bbox, sizeof (group[g].bbox));
+        }
+    }
+
+  /* Draw each group, concatenating its data if it has more than one
+     item. */
+  for (g = 0; g < num_groups; g++)
+    {
+      batch_item_t *first = &item[group[g].first];
+      int type = first->type;
+      void *dat = first->xd.data;
+
+      if (first->next >= 0)
+        {
+          char *p;
+
+          dat = p = scratch_alloc (dsp, group[g].count * datum_size[type], FUNC_NAME);
+          for (i = group[g].first; i >= 0; i = item[i].next)
+            {
+              memcpy (p, item[i].xd.data, item[i].xd.count * datum_size[type]);
+              p += item[i].xd.count * datum_size[type];
+            }
+        }
+
+      if (dl)
+        record_data (dl, first->gc_index, type, dat, group[g].count,
+                     Complex, CoordModeOrigin, FUNC_NAME);
+      else
+        draw_data (dsp, win->win, XGC (first->gc)->gc, type, dat, group[g].count,
+                   Complex, CoordModeOrigin, FUNC_NAME);
+    }
 
-  /* Free the copy of the point data, if one was made. */
-  if (allocatedp)
-    scm_gc_free (dat, num_data * datum_size[type], func);
+  for (i = 0; i < num_items; i++)
+    release_data (&item[i].xd, FUNC_NAME);
 
+  scm_remember_upto_here_1 (items);
 
   return SCM_UNSPECIFIED;
 }
+#undef FUNC_NAME
 
-SCM_DEFINE (scm_x_draw_arcs_x, "x-draw-arcs!", 3, 0, 0,
-            (SCM window,
-             SCM gc,
-             SCM arcs),
-            "Draws a set of arcs on the specified @var{window}\n"
-            "using the specified graphics context @var{gc}.\n"
-            "@var{arcs} should be a uniform array of shorts\n"
-            "with dimensions N x 6, where N is the number of arcs.\n"
-            "The 6 elements that specify each arc are, in order,\n"
-            "X, Y, WIDTH, HEIGHT, ANGLE1 and ANGLE2.")
-#define FUNC_NAME s_scm_x_draw_arcs_x
+/* DRAW CONTEXTS */
+
+/* A draw context binds a drawable and a GC, which are validated when
+   it is made and then only when the display's epoch says that some
+   window, pixmap or GC on it may have been destroyed or freed since.
+   Drawing through it saves looking them up on every call. */
+
+/* Smob print hook for draw contexts. */
+int xdctx_print (SCM ctx, SCM port, scm_print_state *pstate)
+{
+  scm_puts ("#<x-draw-context ", port);
+  scm_intprint (SCM_UNPACK (SCM_CDR (ctx)), 16, port);
+  scm_putc ('>', port);
+  return 1;
+}
+
+/* Smob mark hook for draw contexts: mark the drawable and GC, which
+   mark the display. */
+SCM xdctx_mark (SCM ctx)
+{
+  scm_gc_mark (XDCTX (ctx)->drawable);
+
+  return XDCTX (ctx)->gc;
+}
+
+/* Validate CTX's drawable and GC afresh, and note the epoch of their
+   display that the result holds for. */
+static void validate_dctx (xdctx_t *ctx, int pos, const char *func)
+{
+  SCM display = valid_dsp (ctx->drawable, pos, XDISPLAY_STATE_OPEN, func);
+
+  ctx->dsp = XDISPLAY (display);
+  ctx->win = valid_win (ctx->drawable, pos, ~XWINDOW_STATE_DESTROYED, func);
+  ctx->gc1 = valid_gc (ctx->gc, pos, ~XGC_STATE_FREED, func);
+  if (!scm_is_eq (ctx->gc1->dsp, display))
+    scm_misc_error (func,
+                    "GC ~S is not on the display of ~S",
+                    scm_list_2 (ctx->gc, ctx->drawable));
+  ctx->epoch = ctx->dsp->epoch;
+}
+
+SCM_DEFINE (scm_x_make_draw_context, "x-make-draw-context", 2, 0, 0,
+            (SCM drawable,
+             SCM gc),
+            "Return a draw context for drawing on @var{drawable}, a\n"
+            "window or pixmap, with @var{gc}, for use with\n"
+            "@code{x-context-draw!}.  The drawable and GC are checked\n"
+            "now, and again only after a window, pixmap or GC on their\n"
+            "display has been destroyed or freed.")
+#define FUNC_NAME s_scm_x_make_draw_context
 {
-  return draw (window, gc, arcs, XDATA_ARCS, FUNC_NAME);
+  xdctx_t *ctx = scm_gc_malloc (sizeof (xdctx_t), FUNC_NAME);
+
+  ctx->drawable = drawable;
+  ctx->gc = gc;
+  validate_dctx (ctx, SCM_ARG1, FUNC_NAME);
+
+  SCM_RETURN_NEWSMOB (scm_tc16_xdctx, ctx);
 }
 #undef FUNC_NAME
 
-SCM_DEFINE (scm_x_draw_lines_x, "x-draw-lines!", 3, 0, 0,
-            (SCM window,
-             SCM gc,
-             SCM points),
-            "Draws a set of lines on the specified @var{window}\n"
-            "using the specified graphics context @var{gc}.\n"
-            "@var{points} should be a uniform array of shorts\n"
-            "with dimensions N x 2, where N is the number of points.")
-#define FUNC_NAME s_scm_x_draw_lines_x
+SCM_DEFINE (scm_x_draw_context_set_gc_x, "x-draw-context-set-gc!", 2, 0, 0,
+            (SCM context,
+             SCM gc),
+            "Make draw context @var{context} draw with @var{gc}.")
+#define FUNC_NAME s_scm_x_draw_context_set_gc_x
 {
-  return draw (window, gc, points, XDATA_LINES, FUNC_NAME);
+  xdctx_t *ctx;
+  xgc_t *gc1;
+
+  SCM_ASSERT (SCM_NIMP (context) && (SCM_TYP16 (context) == scm_tc16_xdctx),
+              context, SCM_ARG1, FUNC_NAME);
+  ctx = XDCTX (context);
+
+  /* The drawable is left to be checked again by the next drawing, if
+     the epoch has moved on meanwhile. */
+  gc1 = valid_gc (gc, SCM_ARG2, ~XGC_STATE_FREED, FUNC_NAME);
+  if (!scm_is_eq (gc1->dsp, ctx->win->dsp))
+    scm_misc_error (FUNC_NAME,
+                    "GC ~S is not on the display of ~S",
+                    scm_list_2 (gc, ctx->drawable));
+
+  ctx->gc = gc;
+  ctx->gc1 = gc1;
+
+  return SCM_UNSPECIFIED;
 }
 #undef FUNC_NAME
 
-SCM_DEFINE (scm_x_draw_points_x, "x-draw-points!", 3, 0, 0,
-            (SCM window,
-             SCM gc,
-             SCM points),
-            "Draws a set of points on the specified @var{window}\n"
-            "using the specified graphics context @var{gc}.\n"
-            "@var{points} should be a uniform array of shorts\n"
-            "with dimensions N x 2, where N is the number of points.")
-#define FUNC_NAME s_scm_x_draw_points_x
+SCM_DEFINE (scm_x_context_draw_x, "x-context-draw!", 3, 0, 1,
+            (SCM context,
+             SCM type,
+             SCM data,
+             SCM options),
+            "Draw @var{data} through draw context @var{context}, as\n"
+            "the procedure for @var{type} would on the context's\n"
+            "drawable with its GC.  @var{type} is one of the symbols\n"
+            "@code{arcs}, @code{lines}, @code{points}, @code{segments},\n"
+            "@code{rectangles}, @code{fill-arcs}, @code{fill-polygon}\n"
+            "or @code{fill-rectangles}, and @var{options} are as for\n"
+            "that procedure; for @code{fill-polygon} they may start\n"
+            "with the shape.")
+#define FUNC_NAME s_scm_x_context_draw_x
 {
-  return draw (window, gc, points, XDATA_POINTS, FUNC_NAME);
+  xdctx_t *ctx;
+  int type1, shape = Complex;
+
+  SCM_ASSERT (SCM_NIMP (context) && (SCM_TYP16 (context) == scm_tc16_xdctx),
+              context, SCM_ARG1, FUNC_NAME);
+  ctx = XDCTX (context);
+
+  if (ctx->epoch != ctx->dsp->epoch)
+    validate_dctx (ctx, SCM_ARG1, FUNC_NAME);
+
+  type1 = batch_type (type, FUNC_NAME);
+
+  if ((type1 == XDATA_FILL_POLYGON) && scm_is_pair (options) &&
+      !scm_is_keyword (SCM_CAR (options)))
+    {
+      SCM_VALIDATE_INT_COPY (SCM_ARG4, SCM_CAR (options), shape);
+      SCM_ASSERT_RANGE (SCM_ARG4,
+                        SCM_CAR (options),
+                        (shape >= Complex) && (shape <= Convex));
+      options = SCM_CDR (options);
+    }
+
+  return draw_valid (ctx->dsp, ctx->win, NULL, ctx->gc1, 0,
+                     data, type1, shape, options, FUNC_NAME);
 }
 #undef FUNC_NAME
 
-SCM_DEFINE (scm_x_draw_segments_x, "x-draw-segments!", 3, 0, 0,
-            (SCM window,
+/* GEOMETRY BUFFERS */
+
+/* A geometry buffer accumulates points, segments, rectangles or arcs,
+   one at a time, in growable C storage that the drawing primitives
+   use directly.  Resetting it keeps the storage, so that one buffer
+   can be refilled for each frame without allocating. */
+
+int xgeom_print (SCM geom, SCM port, scm_print_state *pstate)
+{
+  xgeom_t *g = XGEOM (geom);
+
+  scm_puts ("#<x-geometry-buffer ", port);
+  scm_intprint (SCM_UNPACK (SCM_CDR (geom)), 16, port);
+  scm_putc (' ', port);
+  scm_intprint (g->count, 10, port);
+  if (g->count > 0)
+    switch (g->kind)
+      {
+      case XDATA_ARCS:
+        scm_puts (" arcs", port);
+        break;
+      case XDATA_POINTS:
+        scm_puts (" points", port);
+        break;
+      case XDATA_SEGMENTS:
+        scm_puts (" segments", port);
+        break;
+      case XDATA_RECTANGLES:
+        scm_puts (" rectangles", port);
+        break;
+      }
+  scm_putc ('>', port);
+  return 1;
+}
+
+static xgeom_t * valid_geom (SCM arg, int pos, const char *func)
+{
+  SCM_ASSERT (SCM_NIMP (arg) && (SCM_TYP16 (arg) == scm_tc16_xgeom), arg, pos, func);
+
+  return XGEOM (arg);
+}
+
+/* Make room for one more datum of kind KIND in GEOM, and return where
+   its elements go. */
+static short * geom_push (xgeom_t *geom, int kind, const char *func)
+{
+  int k = shorts_per_datum[kind];
+
+  if (geom->count == 0)
+    geom->kind = kind;
+  else if (geom->kind != kind)
+    scm_misc_error (func,
+                    "Geometry buffer holds a different kind of data",
+                    SCM_EOL);
+
+  /* Grow geometrically, so that pushing takes amortized constant
+     time.  Sizes are in shorts, as a buffer's kind can change when
+     it is reset. */
+  if ((geom->count + 1) * k > geom->size)
+    {
+      size_t size = geom->size ? 2 * geom->size : 64 * k;
+
+      /* A buffer made with a small size may not hold even one more
+         datum of this kind after doubling. */
+      if (size < (geom->count + 1) * k)
+        size = (geom->count + 1) * k;
+
+      geom->data = scm_gc_realloc (geom->data,
+                                   geom->size * sizeof (short),
+                                   size * sizeof (short),
+                                   func);
+      geom->size = size;
+    }
+
+  return geom->data + geom->count++ * k;
+}
+
+/* Convert V, a real, to a short as the data conversion does. */
+#define GEOM_SHORT(v) saturate_short (scm_to_double (v), SHRT_MIN, SHRT_MAX)
+#define GEOM_SIZE(v) saturate_short (scm_to_double (v), 0, SHRT_MAX)
+
+SCM_DEFINE (scm_x_make_geometry_buffer, "x-make-geometry-buffer", 0, 1, 0,
+            (SCM size),
+            "Return a new, empty geometry buffer, with room for\n"
+            "@var{size} shorts to start with if @var{size} is given.\n"
+            "A geometry buffer can be passed to the drawing primitives\n"
+            "in place of an array of data of the same kind.")
+#define FUNC_NAME s_scm_x_make_geometry_buffer
+{
+  xgeom_t *g = scm_gc_malloc (sizeof (xgeom_t), FUNC_NAME);
+  size_t size1 = 0;
+
+  if (!SCM_UNBNDP (size))
+    size1 = scm_to_size_t (size);
+
+  g->data  = size1 ? scm_gc_malloc_pointerless (size1 * sizeof (short), FUNC_NAME) : NULL;
+  g->count = 0;
+  g->size  = size1;
+  g->kind  = XDATA_POINTS;
+
+  SCM_RETURN_NEWSMOB (scm_tc16_xgeom, g);
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_geometry_buffer_push_point_x, "x-geometry-buffer-push-point!", 3, 0, 0,
+            (SCM geom,
+             SCM x,
+             SCM y),
+            "Add the point (@var{x}, @var{y}) to @var{geom}.  A buffer\n"
+            "of points can be drawn as points, lines or a polygon.")
+#define FUNC_NAME s_scm_x_geometry_buffer_push_point_x
+{
+  xgeom_t *g = valid_geom (geom, SCM_ARG1, FUNC_NAME);
+  short x1 = GEOM_SHORT (x), y1 = GEOM_SHORT (y);
+  short *d = geom_push (g, XDATA_POINTS, FUNC_NAME);
+
+  d[0] = x1;
+  d[1] = y1;
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_geometry_buffer_push_segment_x, "x-geometry-buffer-push-segment!", 5, 0, 0,
+            (SCM geom,
+             SCM x1,
+             SCM y1,
+             SCM x2,
+             SCM y2),
+            "Add the segment from (@var{x1}, @var{y1}) to\n"
+            "(@var{x2}, @var{y2}) to @var{geom}.")
+#define FUNC_NAME s_scm_x_geometry_buffer_push_segment_x
+{
+  xgeom_t *g = valid_geom (geom, SCM_ARG1, FUNC_NAME);
+  short x1_ = GEOM_SHORT (x1), y1_ = GEOM_SHORT (y1);
+  short x2_ = GEOM_SHORT (x2), y2_ = GEOM_SHORT (y2);
+  short *d = geom_push (g, XDATA_SEGMENTS, FUNC_NAME);
+
+  d[0] = x1_;
+  d[1] = y1_;
+  d[2] = x2_;
+  d[3] = y2_;
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_geometry_buffer_push_rectangle_x, "x-geometry-buffer-push-rectangle!", 5, 0, 0,
+            (SCM geom,
+             SCM x,
+             SCM y,
+             SCM width,
+             SCM height),
+            "Add a rectangle to @var{geom}.")
+#define FUNC_NAME s_scm_x_geometry_buffer_push_rectangle_x
+{
+  xgeom_t *g = valid_geom (geom, SCM_ARG1, FUNC_NAME);
+  short x1 = GEOM_SHORT (x), y1 = GEOM_SHORT (y);
+  short w1 = GEOM_SIZE (width), h1 = GEOM_SIZE (height);
+  short *d = geom_push (g, XDATA_RECTANGLES, FUNC_NAME);
+
+  d[0] = x1;
+  d[1] = y1;
+  d[2] = w1;
+  d[3] = h1;
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_geometry_buffer_push_arc_x, "x-geometry-buffer-push-arc!", 7, 0, 0,
+            (SCM geom,
+             SCM x,
+             SCM y,
+             SCM width,
+             SCM height,
+             SCM angle1,
+             SCM angle2),
+            "Add an arc to @var{geom}.  The angles are in 64ths of\n"
+            "a degree, as for @code{x-draw-arcs!}.")
+#define FUNC_NAME s_scm_x_geometry_buffer_push_arc_x
+{
+  xgeom_t *g = valid_geom (geom, SCM_ARG1, FUNC_NAME);
+  short x1 = GEOM_SHORT (x), y1 = GEOM_SHORT (y);
+  short w1 = GEOM_SIZE (width), h1 = GEOM_SIZE (height);
+  short a1 = GEOM_SHORT (angle1), a2 = GEOM_SHORT (angle2);
+  short *d = geom_push (g, XDATA_ARCS, FUNC_NAME);
+
+  d[0] = x1;
+  d[1] = y1;
+  d[2] = w1;
+  d[3] = h1;
+  d[4] = a1;
+  d[5] = a2;
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+#undef GEOM_SHORT
+#undef GEOM_SIZE
+
+SCM_DEFINE (scm_x_geometry_buffer_reset_x, "x-geometry-buffer-reset!", 1, 0, 0,
+            (SCM geom),
+            "Empty @var{geom}, keeping its storage for reuse.  After\n"
+            "a reset, any kind of data can be pushed.")
+#define FUNC_NAME s_scm_x_geometry_buffer_reset_x
+{
+  xgeom_t *g = valid_geom (geom, SCM_ARG1, FUNC_NAME);
+
+  g->count = 0;
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_geometry_buffer_length, "x-geometry-buffer-length", 1, 0, 0,
+            (SCM geom),
+            "Return the number of points, segments, rectangles or arcs\n"
+            "in @var{geom}.")
+#define FUNC_NAME s_scm_x_geometry_buffer_length
+{
+  xgeom_t *g = valid_geom (geom, SCM_ARG1, FUNC_NAME);
+
+  return scm_from_size_t (g->count);
+}
+#undef FUNC_NAME
+
+
+/* DISPLAY LISTS */
+
+/* A display list records drawing operations - draws, fills, area
+   copies and GC changes - in a compact C buffer, so that they can be
+   replayed on a drawable with a single primitive call.  The data of
+   each draw is converted to Xlib structures once, when it is
+   recorded, and the GCs and source drawables that the operations use
+   are validated once per replay rather than once per operation.
+
+   The drawing primitives and x-copy-area! record into a display list
+   when one is passed in place of the destination drawable. */
+
+#define XDLIST_OP_DRAW              1
+#define XDLIST_OP_COPY_AREA         2
+#define XDLIST_OP_CHANGE_GC         3
+
+/* Round up record sizes so that every record is suitably aligned. */
+#define XDLIST_ALIGN(n) (((n) + sizeof (long) - 1) & ~(sizeof (long) - 1))
+
+/* Header common to all recorded operations. */
+typedef struct xdlist_op_t
+{
+  /* One of the XDLIST_OP_* values. */
+  int op;
+
+  /* Index of the operation's GC in the display list's object table. */
+  int gc;
+
+  /* Size of the whole record, including any data that follows. */
+  size_t size;
+
+} xdlist_op_t;
+
+typedef struct xdlist_draw_t
+{
+  xdlist_op_t hdr;
+
+  /* XDATA_* type, number of data, polygon shape and coordinate
+     mode. */
+  int type;
+  int count;
+  int shape;
+  int mode;
+
+  /* The data follow, at XDLIST_ALIGN (sizeof (xdlist_draw_t)). */
+
+} xdlist_draw_t;
+
+typedef struct xdlist_copy_t
+{
+  xdlist_op_t hdr;
+
+  /* Index of the source drawable in the object table. */
+  int src;
+
+  int src_x, src_y;
+  unsigned int width, height;
+  int dst_x, dst_y;
+
+} xdlist_copy_t;
+
+typedef struct xdlist_change_t
+{
+  xdlist_op_t hdr;
+
+  unsigned long mask;
+  XGCValues values;
+
+  /* Indices in the object table of the smobs given for pixmap and
+     font fields, or -1. */
+  int objs[XGC_NUM_OBJS];
+
+} xdlist_change_t;
+
+/* An entry in a display list's object table. */
+typedef struct xdlist_obj_t
+{
+  /* The GC or drawable smob. */
+  SCM obj;
+
+  /* The corresponding Xlib value, filled in when replaying. */
+  GC gc;
+  Drawable d;
+
+} xdlist_obj_t;
+
+/* Smob print hook for display lists. */
+int xdlist_print (SCM dlist, SCM port, scm_print_state *pstate)
+{
+  scm_puts ("#<x-display-list ", port);
+  scm_intprint (SCM_UNPACK (SCM_CDR (dlist)), 16, port);
+  scm_putc (' ', port);
+  scm_intprint (XDLIST (dlist)->num_ops, 10, port);
+  scm_puts (" ops>", port);
+  return 1;
+}
+
+/* Smob mark hook for display lists: mark the recorded objects and
+   their display. */
+SCM xdlist_mark (SCM dlist)
+{
+  xdlist_t *dl = XDLIST (dlist);
+  int i;
+
+  for (i = 0; i < dl->num_objs; i++)
+    scm_gc_mark (dl->objs[i].obj);
+
+  return dl->dsp;
+}
+
+/* Return the index of OBJ in DL's object table, adding it if it is
+   not there yet.  OBJ must belong to DISPLAY. */
+static int dlist_object (xdlist_t *dl, SCM obj, SCM display, const char *func)
+{
+  int i;
+
+  if (scm_is_false (dl->dsp))
+    dl->dsp = display;
+  else if (!scm_is_eq (dl->dsp, display))
+    scm_misc_error (func,
+                    "~S is not on the display of this display list",
+                    scm_list_1 (obj));
+
+  /* Search backwards, as the object most likely to be wanted is the
+     one used by the last operation recorded. */
+  for (i = dl->num_objs - 1; i >= 0; i--)
+    if (scm_is_eq (dl->objs[i].obj, obj))
+      return i;
+
+  if (dl->num_objs == dl->max_objs)
+    {
+      int max_objs = dl->max_objs ? 2 * dl->max_objs : 8;
+
+      dl->objs = scm_gc_realloc (dl->objs,
+                                 dl->max_objs * sizeof (xdlist_obj_t),
+                                 max_objs * sizeof (xdlist_obj_t),
+                                 func);
+      dl->max_objs = max_objs;
+    }
+
+  dl->objs[dl->num_objs].obj = obj;
+  return dl->num_objs++;
+}
+
+/* Append a record of SIZE bytes to DL and return it. */
+static xdlist_op_t * dlist_append (xdlist_t *dl, int op, int gc, size_t size, const char *func)
+{
+  xdlist_op_t *rec;
+
+  size = XDLIST_ALIGN (size);
+
+  if (dl->used + size > dl->size)
+    {
+      size_t new_size = dl->size ? dl->size : 1024;
+
+      while (dl->used + size > new_size)
+        new_size *= 2;
+
+      dl->ops = scm_gc_realloc (dl->ops, dl->size, new_size, func);
+      dl->size = new_size;
+    }
+
+  rec = (xdlist_op_t *) (dl->ops + dl->used);
+  rec->op = op;
+  rec->gc = gc;
+  rec->size = size;
+
+  dl->used += size;
+  dl->num_ops++;
+
+  return rec;
+}
+
+/* Record the drawing of NUM_DATA data of type TYPE at DAT, using
+   the GC at index GC of DL's object table.  A polygon that replay
+   could not send is refused now, rather than part way through a
+   replay. */
+static void record_data (xdlist_t *dl, int gc, int type, void *dat, int num_data, int shape, int mode, const char *func)
+{
+  xdlist_draw_t *rec;
+  size_t header = XDLIST_ALIGN (sizeof (xdlist_draw_t));
+
+  check_polygon_size (XDISPLAY (dl->dsp), type, num_data, func);
+
+  rec = (xdlist_draw_t *) dlist_append (dl,
+                                        XDLIST_OP_DRAW,
+                                        gc,
+                                        header + num_data * datum_size[type],
+                                        func);
+  rec->type  = type;
+  rec->count = num_data;
+  rec->shape = shape;
+  rec->mode  = mode;
+  memcpy (((char *) rec) + header, dat, num_data * datum_size[type]);
+}
+
+static SCM record_copy_area (SCM dlist,
+                             SCM source,
+                             SCM gc,
+                             int src_x, int src_y,
+                             unsigned int width, unsigned int height,
+                             int dst_x, int dst_y,
+                             const char *func)
+{
+  xdlist_t *dl = XDLIST (dlist);
+  SCM display1;
+  xdlist_copy_t *rec;
+  int src_index, gc_index;
+
+  display1 = valid_dsp (source, SCM_ARG1, XDISPLAY_STATE_OPEN, func);
+  valid_win (source, SCM_ARG1, (XWINDOW_STATE_MAPPED |
+                                XWINDOW_STATE_PIXMAP |
+                                XWINDOW_STATE_THIRD_PARTY), func);
+  valid_gc (gc, SCM_ARG3, (XGC_STATE_CREATED | XGC_STATE_DEFAULT | XGC_STATE_POOLED), func);
+  src_index = dlist_object (dl, source, display1, func);
+  gc_index = dlist_object (dl, gc, valid_dsp (gc, SCM_ARG3, XDISPLAY_STATE_OPEN, func), func);
+
+  rec = (xdlist_copy_t *) dlist_append (dl,
+                                        XDLIST_OP_COPY_AREA,
+                                        gc_index,
+                                        sizeof (xdlist_copy_t),
+                                        func);
+  rec->src    = src_index;
+  rec->src_x  = src_x;
+  rec->src_y  = src_y;
+  rec->width  = width;
+  rec->height = height;
+  rec->dst_x  = dst_x;
+  rec->dst_y  = dst_y;
+
+  return SCM_UNSPECIFIED;
+}
+
+SCM_DEFINE (scm_x_make_display_list, "x-make-display-list", 0, 0, 0,
+            (),
+            "Return a new, empty display list.  Drawing primitives\n"
+            "and @code{x-copy-area!} record into a display list when it\n"
+            "is passed in place of the destination drawable, and\n"
+            "@code{x-display-list-replay!} sends the recorded operations\n"
+            "to a drawable.")
+#define FUNC_NAME s_scm_x_make_display_list
+{
+  xdlist_t *dl = scm_gc_malloc (sizeof (xdlist_t), FUNC_NAME);
+
+  dl->dsp      = SCM_BOOL_F;
+  dl->ops      = NULL;
+  dl->used     = 0;
+  dl->size     = 0;
+  dl->num_ops  = 0;
+  dl->objs     = NULL;
+  dl->num_objs = 0;
+  dl->max_objs = 0;
+
+  SCM_RETURN_NEWSMOB (scm_tc16_xdlist, dl);
+}
+#undef FUNC_NAME
+
+static xdlist_t * valid_dlist (SCM arg, int pos, const char *func)
+{
+  SCM_ASSERT (SCM_NIMP (arg) && (SCM_TYP16 (arg) == scm_tc16_xdlist), arg, pos, func);
+
+  return XDLIST (arg);
+}
+
+SCM_DEFINE (scm_x_display_list_clear_x, "x-display-list-clear!", 1, 0, 0,
+            (SCM dlist),
+            "Discard all the operations recorded in @var{dlist}.\n"
+            "Its buffers are kept for reuse.")
+#define FUNC_NAME s_scm_x_display_list_clear_x
+{
+  xdlist_t *dl = valid_dlist (dlist, SCM_ARG1, FUNC_NAME);
+
+  dl->dsp      = SCM_BOOL_F;
+  dl->used     = 0;
+  dl->num_ops  = 0;
+  dl->num_objs = 0;
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_display_list_change_gc_x, "x-display-list-change-gc!", 2, 0, 1,
+            (SCM dlist,
              SCM gc,
-             SCM segments),
-            "Draws a set of line segments on the specified @var{window}\n"
-            "using the specified graphics context @var{gc}.\n"
-            "@var{segments} should be a uniform array of shorts\n"
-            "with dimensions N x 4, where N is the number of segments.\n"
-            "The 4 elements that specify each line segment are, in order,\n"
-            "X1, Y1, X2, Y2.")
-#define FUNC_NAME s_scm_x_draw_segments_x
+             SCM changes),
+            "Record in @var{dlist} a change to @var{gc}, as made by\n"
+            "@code{x-change-gc!}.  The change is made when @var{dlist}\n"
+            "is replayed, and persists afterwards.")
+#define FUNC_NAME s_scm_x_display_list_change_gc_x
 {
-  return draw (window, gc, segments, XDATA_SEGMENTS, FUNC_NAME);
+  xdlist_t *dl = valid_dlist (dlist, SCM_ARG1, FUNC_NAME);
+  SCM display1;
+  xdlist_change_t *rec;
+  XGCValues gcv;
+  SCM objs[XGC_NUM_OBJS];
+  int obj_index[XGC_NUM_OBJS];
+  unsigned long mask;
+  int gc_index;
+  int fld;
+
+  display1 = valid_dsp (gc, SCM_ARG2, XDISPLAY_STATE_OPEN, FUNC_NAME);
+  valid_gc (gc, SCM_ARG2, (XGC_STATE_CREATED | XGC_STATE_DEFAULT), FUNC_NAME);
+
+  mask = parse_gc_changes (changes, &gcv, objs, FUNC_NAME);
+  gc_index = dlist_object (dl, gc, display1, FUNC_NAME);
+
+  for (fld = 0; fld < XGC_NUM_OBJS; fld++)
+    obj_index[fld] = -1;
+  for (fld = 0; fld < 23; fld++)
+    {
+      int obj = gc_fields[fld].obj;
+
+      if ((mask & (1L << fld)) && (obj >= 0) && scm_is_true (objs[obj]))
+        obj_index[obj] = dlist_object (dl, objs[obj], display1, FUNC_NAME);
+    }
+
+  rec = (xdlist_change_t *) dlist_append (dl,
+                                          XDLIST_OP_CHANGE_GC,
+                                          gc_index,
+                                          sizeof (xdlist_change_t),
+                                          FUNC_NAME);
+  rec->mask   = mask;
+  rec->values = gcv;
+  memcpy (rec->objs, obj_index, sizeof (obj_index));
+
+  return SCM_UNSPECIFIED;
 }
 #undef FUNC_NAME
 
-SCM_DEFINE (scm_x_draw_rectangles_x, "x-draw-rectangles!", 3, 0, 0,
-            (SCM window,
-             SCM gc,
-             SCM rectangles),
-            "Draws a set of rectangles on the specified @var{window}\n"
-            "using the specified graphics context @var{gc}.\n"
-            "@var{rectangles} should be a uniform array of shorts\n"
-            "with dimensions N x 4, where N is the number of rectangles.\n"
-            "The 4 elements that specify each rectangle are, in order,\n"
-            "X1, Y1, WIDTH, HEIGHT.")
-#define FUNC_NAME s_scm_x_draw_rectangles_x
+SCM_DEFINE (scm_x_display_list_replay_x, "x-display-list-replay!", 2, 0, 0,
+            (SCM dlist,
+             SCM drawable),
+            "Perform the operations recorded in @var{dlist}, in order,\n"
+            "on @var{drawable}.  The drawable and the GCs and source\n"
+            "drawables used by the recorded operations are each\n"
+            "validated once, before anything is drawn.")
+#define FUNC_NAME s_scm_x_display_list_replay_x
 {
-  return draw (window, gc, rectangles, XDATA_RECTANGLES, FUNC_NAME);
+  xdlist_t *dl = valid_dlist (dlist, SCM_ARG1, FUNC_NAME);
+  SCM display1;
+  xdisplay_t *dsp;
+  xwindow_t *win;
+  size_t offset;
+  int i;
+
+  display1 = valid_dsp (drawable, SCM_ARG2, XDISPLAY_STATE_OPEN, FUNC_NAME);
+  dsp = XDISPLAY (display1);
+  win = valid_win (drawable, SCM_ARG2, ~XWINDOW_STATE_DESTROYED, FUNC_NAME);
+
+  if (dl->num_ops == 0)
+    return SCM_UNSPECIFIED;
+
+  if (!scm_is_eq (dl->dsp, display1))
+    scm_misc_error (FUNC_NAME,
+                    "Display list ~S was recorded for another display",
+                    scm_list_1 (dlist));
+
+  /* Validate all the objects that the operations use, and look up
+     their Xlib values. */
+  for (i = 0; i < dl->num_objs; i++)
+    {
+      SCM obj = dl->objs[i].obj;
+
+      if (!SCM_NIMP (obj))
+        continue;
+      if (SCM_TYP16 (obj) == scm_tc16_xgc)
+        dl->objs[i].gc = valid_gc (obj, SCM_ARG1, ~XGC_STATE_FREED, FUNC_NAME)->gc;
+      else if (SCM_TYP16 (obj) == scm_tc16_xfont)
+        valid_font (obj, SCM_ARG1, XFONT_STATE_LOADED, FUNC_NAME);
+      else
+        dl->objs[i].d = valid_win (obj, SCM_ARG1, (XWINDOW_STATE_MAPPED |
+                                                   XWINDOW_STATE_PIXMAP |
+                                                   XWINDOW_STATE_THIRD_PARTY),
+                                   FUNC_NAME)->win;
+    }
+
+  scratch_reset (dsp, FUNC_NAME);
+
+  for (offset = 0; offset < dl->used; )
+    {
+      xdlist_op_t *rec = (xdlist_op_t *) (dl->ops + offset);
+      GC gc = dl->objs[rec->gc].gc;
+
+      switch (rec->op)
+        {
+        case XDLIST_OP_DRAW:
+          {
+            xdlist_draw_t *draw = (xdlist_draw_t *) rec;
+
+            if (draw->count > 0)
+              draw_data (dsp, win->win, gc, draw->type,
+                         ((char *) draw) + XDLIST_ALIGN (sizeof (xdlist_draw_t)),
+                         draw->count, draw->shape, draw->mode, FUNC_NAME);
+          }
+          break;
+
+        case XDLIST_OP_COPY_AREA:
+          {
+            xdlist_copy_t *copy = (xdlist_copy_t *) rec;
+
+            XCopyArea (dsp->dsp, dl->objs[copy->src].d, win->win, gc,
+                       copy->src_x, copy->src_y,
+                       copy->width, copy->height,
+                       copy->dst_x, copy->dst_y);
+          }
+          break;
+
+        case XDLIST_OP_CHANGE_GC:
+          {
+            xdlist_change_t *change = (xdlist_change_t *) rec;
+            SCM objs[XGC_NUM_OBJS];
+            int j;
+
+            for (j = 0; j < XGC_NUM_OBJS; j++)
+              objs[j] = ((change->objs[j] >= 0) ?
+                         dl->objs[change->objs[j]].obj : SCM_BOOL_F);
+
+            change_gc (dsp,
+                       (xgc_t *) SCM_SMOB_DATA (dl->objs[rec->gc].obj),
+                       change->mask,
+                       &change->values,
+                       objs);
+          }
+          break;
+
+        default:
+          scm_misc_error (FUNC_NAME,
+                          "Corrupt display list operation (~S)",
+                          scm_list_1 (scm_from_int (rec->op)));
+        }
+
+      offset += rec->size;
+    }
+
+  return SCM_UNSPECIFIED;
 }
 #undef FUNC_NAME
 
@@ -2130,6 +6493,8 @@ static SCM lookup_window (SCM display, XID id, const char *func)
       win->state = XWINDOW_STATE_THIRD_PARTY;
       win->dsp   = display;
       win->win   = id;
+      win->root  = None;
+      win->depth = 0;
 
       SCM_NEWSMOB (window, scm_tc16_xwindow, win);
 
@@ -2581,13 +6946,492 @@ static SCM copy_event_fields (SCM display, XEvent *e, SCM event, const char *fun
 
 static void validate_event_arg (SCM event, int pos, const char *func)
 {
-  if (!SCM_UNBNDP (event))
+  if (!SCM_UNBNDP (event) &&
+      !(SCM_NIMP (event) && (SCM_TYP16 (event) == scm_tc16_xevent)))
     {
       SCM_ASSERT (scm_is_vector (event), event, pos, func);
       SCM_ASSERT (scm_c_vector_length (event) == XEVENT_NUM_SLOTS, event, pos, func);
     }
 }
 
+/* RAW EVENTS
+
+   A raw event keeps the XEvent that Xlib delivered, and only works out
+   the fields that are asked for.  The type, serial number, send_event
+   flag, display and window, which are what handlers mostly look at,
+   are worked out on their own; asking for any other field decodes
+   them all, into an event vector kept for the purpose. */
+
+/* Smob print hook for raw events. */
+int xevent_print (SCM event, SCM port, scm_print_state *pstate)
+{
+  scm_puts ("#<x-raw-event ", port);
+  scm_intprint (SCM_UNPACK (SCM_CDR (event)), 16, port);
+  scm_putc (' ', port);
+  scm_intprint (XEVENT (event)->e.type, 10, port);
+  scm_putc ('>', port);
+  return 1;
+}
+
+/* Smob mark hook for raw events: mark the display and the vector. */
+SCM xevent_mark (SCM event)
+{
+  scm_gc_mark (XEVENT (event)->dsp);
+
+  return XEVENT (event)->vector;
+}
+
+/* Store the event E from DISPLAY in EVENT, as copy_event_fields does,
+   except that a raw event is given E as it is. */
+static SCM store_event (SCM display, XEvent *e, SCM event, const char *func)
+{
+  xevent_t *ev;
+
+  if (SCM_UNBNDP (event) || (SCM_TYP16 (event) != scm_tc16_xevent))
+    return copy_event_fields (display, e, event, func);
+
+  ev = XEVENT (event);
+  ev->dsp = display;
+  ev->e = *e;
+  ev->decoded = 0;
+
+  return event;
+}
+
+/* Return the window slot of raw event EV, exactly as copy_event_fields
+   would fill it in.  That is XAnyEvent's window, except for the events
+   that a parent can be sent about a child, where it is the child, and
+   the events whose own fields share the slot: the drawable of
+   GraphicsExpose and NoExpose, and the owner of SelectionRequest.
+   Types that leave the slot alone give the unspecified value. */
+static SCM event_window (xevent_t *ev, const char *func)
+{
+  XEvent *e = &ev->e;
+
+  switch (e->type)
+    {
+    case CreateNotify:      return lookup_window (ev->dsp, e->xcreatewindow.window, func);
+    case DestroyNotify:     return lookup_window (ev->dsp, e->xdestroywindow.window, func);
+    case UnmapNotify:       return lookup_window (ev->dsp, e->xunmap.window, func);
+    case MapNotify:         return lookup_window (ev->dsp, e->xmap.window, func);
+    case MapRequest:        return lookup_window (ev->dsp, e->xmaprequest.window, func);
+    case ReparentNotify:    return lookup_window (ev->dsp, e->xreparent.window, func);
+    case ConfigureNotify:   return lookup_window (ev->dsp, e->xconfigure.window, func);
+    case ConfigureRequest:  return lookup_window (ev->dsp, e->xconfigurerequest.window, func);
+    case GravityNotify:     return lookup_window (ev->dsp, e->xgravity.window, func);
+    case CirculateNotify:   return lookup_window (ev->dsp, e->xcirculate.window, func);
+    case CirculateRequest:  return lookup_window (ev->dsp, e->xcirculaterequest.window, func);
+
+    /* XEVENT_SLOT_DRAWABLE, which is never filled in. */
+    case GraphicsExpose:
+    case NoExpose:
+      return SCM_BOOL_F;
+
+    /* XEVENT_SLOT_OWNER. */
+    case SelectionRequest:  return lookup_window (ev->dsp, e->xselectionrequest.owner, func);
+
+    case KeyPress:
+    case KeyRelease:
+    case ButtonPress:
+    case ButtonRelease:
+    case MotionNotify:
+    case EnterNotify:
+    case LeaveNotify:
+    case FocusIn:
+    case FocusOut:
+    case KeymapNotify:
+    case Expose:
+    case VisibilityNotify:
+    case PropertyNotify:
+    case SelectionClear:
+    case ColormapNotify:
+    case ClientMessage:
+    case MappingNotify:
+      return lookup_window (ev->dsp, e->xany.window, func);
+
+    default:
+      return SCM_UNSPECIFIED;
+    }
+}
+
+SCM_DEFINE (scm_x_make_raw_event, "x-make-raw-event", 0, 0, 0,
+            (void),
+            "Return a new raw event.  A raw event can be passed to the\n"
+            "event procedures in place of an event vector.  It keeps\n"
+            "the event as Xlib delivered it, and only works out a field\n"
+            "when it is asked for, with @code{x-event-ref} or one of\n"
+            "the @code{x-event:} accessors.")
+#define FUNC_NAME s_scm_x_make_raw_event
+{
+  xevent_t *ev = scm_gc_malloc (sizeof (xevent_t), FUNC_NAME);
+
+  ev->dsp = SCM_BOOL_F;
+  memset (&ev->e, 0, sizeof (ev->e));
+  ev->vector = SCM_BOOL_F;
+  ev->decoded = 0;
+
+  SCM_RETURN_NEWSMOB (scm_tc16_xevent, ev);
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_event_ref, "x-event-ref", 2, 0, 0,
+            (SCM event,
+             SCM slot),
+            "Return slot number @var{slot} of @var{event}, which is an\n"
+            "event vector or a raw event.")
+#define FUNC_NAME s_scm_x_event_ref
+{
+  xevent_t *ev;
+  int slot1;
+
+  SCM_VALIDATE_INT_COPY (SCM_ARG2, slot, slot1);
+  SCM_ASSERT_RANGE (SCM_ARG2, slot, (slot1 >= 0) && (slot1 < XEVENT_NUM_SLOTS));
+
+  if (scm_is_vector (event))
+    {
+      validate_event_arg (event, SCM_ARG1, FUNC_NAME);
+      return scm_c_vector_ref (event, slot1);
+    }
+
+  SCM_ASSERT (SCM_NIMP (event) && (SCM_TYP16 (event) == scm_tc16_xevent),
+              event, SCM_ARG1, FUNC_NAME);
+  ev = XEVENT (event);
+
+  if (scm_is_false (ev->dsp))
+    scm_misc_error (FUNC_NAME, "No event has been stored in ~S", scm_list_1 (event));
+
+  /* copy_event_fields leaves events of other types unspecified. */
+  if (!ev->decoded && (ev->e.type >= KeyPress) && (ev->e.type <= MappingNotify))
+    switch (slot1)
+      {
+      case XEVENT_SLOT_TYPE:       return scm_from_int (ev->e.xany.type);
+      case XEVENT_SLOT_SERIAL:     return scm_from_int (ev->e.xany.serial);
+      case XEVENT_SLOT_SEND_EVENT: return SCM_BOOL (ev->e.xany.send_event);
+      case XEVENT_SLOT_DISPLAY:    return ev->dsp;
+      case XEVENT_SLOT_WINDOW:     return event_window (ev, FUNC_NAME);
+      }
+
+  if (!ev->decoded)
+    {
+      ev->vector = copy_event_fields (ev->dsp, &ev->e,
+                                      scm_is_true (ev->vector) ? ev->vector : SCM_UNDEFINED,
+                                      FUNC_NAME);
+      ev->decoded = 1;
+    }
+
+  return scm_c_vector_ref (ev->vector, slot1);
+}
+#undef FUNC_NAME
+
+/* EVENT COMPRESSION */
+
+SCM_SYMBOL (sym_motion, "motion");
+SCM_SYMBOL (sym_expose, "expose");
+SCM_SYMBOL (sym_configure, "configure");
+
+/* Fold into E, just taken off the head of DSP's queue, the events
+   that follow it and that DSP compresses into it: later MotionNotify
+   or ConfigureNotify events for the same window replace it, and the
+   rest of a series of Expose events for a window is merged into it,
+   giving the bounding box of the exposed rectangles and the count of
+   the last one merged.  Only events that can be read without
+   waiting are looked at, so a series that has not all arrived yet
+   goes on in the next event. */
+static void compress_event (xdisplay_t *dsp, XEvent *e)
+{
+  XEvent next, taken;
+
+  if (!dsp->compress)
+    return;
+
+  while (XEventsQueued (dsp->dsp, QueuedAfterReading) > 0)
+    {
+      XPeekEvent (dsp->dsp, &next);
+      if ((next.type != e->type) || (next.xany.window != e->xany.window))
+        return;
+
+      switch (e->type)
+        {
+        case MotionNotify:
+          if (!(dsp->compress & XCOMPRESS_MOTION))
+            return;
+          break;
+
+        case ConfigureNotify:
+          /* Events about different children come to the same parent. */
+          if (!(dsp->compress & XCOMPRESS_CONFIGURE) ||
+              (next.xconfigure.window != e->xconfigure.window))
+            return;
+          break;
+
+        case Expose:
+          if (!(dsp->compress & XCOMPRESS_EXPOSE) || (e->xexpose.count == 0))
+            return;
+          {
+            int x0 = e->xexpose.x, y0 = e->xexpose.y;
+            int x1 = x0 + e->xexpose.width, y1 = y0 + e->xexpose.height;
+            int nx1 = next.xexpose.x + next.xexpose.width;
+            int ny1 = next.xexpose.y + next.xexpose.height;
+
+            if (next.xexpose.x < x0)
+              x0 = next.xexpose.x;
+            if (next.xexpose.y < y0)
+              y0 = next.xexpose.y;
+            if (nx1 > x1)
+              x1 = nx1;
+            if (ny1 > y1)
+              y1 = ny1;
+
+            next.xexpose.x = x0;
+            next.xexpose.y = y0;
+            next.xexpose.width = x1 - x0;
+            next.xexpose.height = y1 - y0;
+          }
+          break;
+
+        default:
+          return;
+        }
+
+      /* The event peeked at is still at the head of the queue. */
+      XNextEvent (dsp->dsp, &taken);
+      *e = next;
+    }
+}
+
+SCM_DEFINE (scm_x_set_event_compression_x, "x-set-event-compression!", 2, 0, 0,
+            (SCM display,
+             SCM kinds),
+            "Make @code{x-next-event!} and @code{x-next-events!} on\n"
+            "@var{display} compress the kinds of event in the list\n"
+            "@var{kinds}, of the symbols @code{motion}, @code{expose}\n"
+            "and @code{configure}.  A MotionNotify or ConfigureNotify\n"
+            "event followed in the queue by others of the same kind for\n"
+            "the same window is replaced by the last of them.  An Expose\n"
+            "event with a nonzero count is merged with the rest of its\n"
+            "series into one event for the bounding box of their\n"
+            "rectangles, with the count of the last one merged, which is\n"
+            "zero unless the series has not all arrived yet.  Only events\n"
+            "already received are merged, so compression never waits.\n"
+            "The empty list turns compression off.")
+#define FUNC_NAME s_scm_x_set_event_compression_x
+{
+  xdisplay_t *dsp;
+  int compress = 0;
+  SCM l;
+
+  dsp = XDISPLAY (valid_dsp (display, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
+  SCM_ASSERT (scm_ilength (kinds) >= 0, kinds, SCM_ARG2, FUNC_NAME);
+
+  for (l = kinds; !scm_is_null (l); l = SCM_CDR (l))
+    {
+      SCM kind = SCM_CAR (l);
+
+      if (scm_is_eq (kind, sym_motion))
+        compress |= XCOMPRESS_MOTION;
+      else if (scm_is_eq (kind, sym_expose))
+        compress |= XCOMPRESS_EXPOSE;
+      else if (scm_is_eq (kind, sym_configure))
+        compress |= XCOMPRESS_CONFIGURE;
+      else
+        scm_misc_error (FUNC_NAME, "Unknown kind of event compression ~S",
+                        scm_list_1 (kind));
+    }
+
+  dsp->compress = compress;
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+/* EVENT DISPATCH */
+
+/* Return the slot of DSP's handler table for events of type TYPE
+   reported to WIN: the one holding its handler, if it has one, and
+   otherwise the first empty or deleted one that a handler for it
+   could go in.  The table must have an empty slot. */
+static xhandler_t * event_handler_slot (xdisplay_t *dsp, Window win, int type)
+{
+  unsigned long mask = dsp->handlers_size - 1;
+  unsigned long i = ((unsigned long) win * 31 + type) & mask;
+  xhandler_t *free_slot = NULL;
+
+  for (;; i = (i + 1) & mask)
+    {
+      xhandler_t *h = &dsp->handlers[i];
+
+      if (h->type == XHANDLER_EMPTY)
+        return free_slot ? free_slot : h;
+      if (h->type == XHANDLER_DELETED)
+        {
+          if (!free_slot)
+            free_slot = h;
+        }
+      else if ((h->win == win) && (h->type == type))
+        return h;
+    }
+}
+
+/* Return the procedure that handles events of type TYPE reported to
+   WIN on DSP, or #f. */
+static SCM find_event_handler (xdisplay_t *dsp, Window win, int type)
+{
+  xhandler_t *h;
+
+  if (dsp->handlers_size == 0)
+    return SCM_BOOL_F;
+
+  h = event_handler_slot (dsp, win, type);
+
+  return (h->type == type) ? h->proc : SCM_BOOL_F;
+}
+
+/* Remove the handlers of all types of event reported to WIN on DSP. */
+static void remove_event_handlers (xdisplay_t *dsp, Window win)
+{
+  int i;
+
+  for (i = 0; i < dsp->handlers_size; i++)
+    if ((dsp->handlers[i].type > XHANDLER_DELETED) && (dsp->handlers[i].win == win))
+      {
+        dsp->handlers[i].type = XHANDLER_DELETED;
+        dsp->handlers[i].proc = SCM_BOOL_F;
+      }
+}
+
+SCM_DEFINE (scm_x_set_event_handler_x, "x-set-event-handler!", 3, 0, 0,
+            (SCM window,
+             SCM type,
+             SCM proc),
+            "Make @code{x-dispatch-events!} call @var{proc} with each\n"
+            "event of type @var{type} that is reported to @var{window},\n"
+            "or, if @var{proc} is @code{#f}, stop handling them.  The\n"
+            "handlers of a window are removed when it is destroyed with\n"
+            "@code{x-destroy-window!}, or when a DestroyNotify event\n"
+            "reported to it about itself is dispatched.")
+#define FUNC_NAME s_scm_x_set_event_handler_x
+{
+  xdisplay_t *dsp;
+  xwindow_t *win;
+  xhandler_t *h;
+  int type1;
+
+  dsp = XDISPLAY (valid_dsp (window, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
+  win = valid_win (window, SCM_ARG1, ~(XWINDOW_STATE_DESTROYED | XWINDOW_STATE_PIXMAP), FUNC_NAME);
+  SCM_VALIDATE_INT_COPY (SCM_ARG2, type, type1);
+  SCM_ASSERT_RANGE (SCM_ARG2, type, (type1 >= KeyPress) && (type1 < LASTEvent));
+  if (scm_is_true (proc))
+    SCM_VALIDATE_PROC (SCM_ARG3, proc);
+
+  if (scm_is_false (proc))
+    {
+      if (scm_is_true (find_event_handler (dsp, win->win, type1)))
+        {
+          h = event_handler_slot (dsp, win->win, type1);
+          h->type = XHANDLER_DELETED;
+          h->proc = SCM_BOOL_F;
+        }
+      return SCM_UNSPECIFIED;
+    }
+
+  /* Keep at least a quarter of the table empty, so that lookups stay
+     short, rebuilding it without the deleted entries, and twice the
+     size if it is more than half full of handlers. */
+  if (4 * (dsp->handlers_used + 1) > 3 * dsp->handlers_size)
+    {
+      xhandler_t *old = dsp->handlers;
+      int old_size = dsp->handlers_size;
+      int count = 0, i;
+
+      for (i = 0; i < old_size; i++)
+        if (old[i].type > XHANDLER_DELETED)
+          count++;
+
+      dsp->handlers_size = old_size ? old_size : 16;
+      while (2 * (count + 1) > dsp->handlers_size)
+        dsp->handlers_size *= 2;
+      dsp->handlers = scm_gc_malloc (dsp->handlers_size * sizeof (xhandler_t), FUNC_NAME);
+      for (i = 0; i < dsp->handlers_size; i++)
+        {
+          dsp->handlers[i].type = XHANDLER_EMPTY;
+          dsp->handlers[i].proc = SCM_BOOL_F;
+        }
+      dsp->handlers_used = count;
+
+      for (i = 0; i < old_size; i++)
+        if (old[i].type > XHANDLER_DELETED)
+          *event_handler_slot (dsp, old[i].win, old[i].type) = old[i];
+      if (old)
+        scm_gc_free (old, old_size * sizeof (xhandler_t), FUNC_NAME);
+    }
+
+  h = event_handler_slot (dsp, win->win, type1);
+  if (h->type == XHANDLER_EMPTY)
+    dsp->handlers_used++;
+  h->win = win->win;
+  h->type = type1;
+  h->proc = proc;
+
+  return SCM_UNSPECIFIED;
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_dispatch_events_x, "x-dispatch-events!", 1, 1, 0,
+            (SCM display,
+             SCM event),
+            "Wait for an event on @var{display} if none has been\n"
+            "received, then take each event received off the queue and\n"
+            "call the procedure that @code{x-set-event-handler!} set for\n"
+            "its window and type with it.  Events that have no handler\n"
+            "are dropped without being decoded.  @var{event}, an event\n"
+            "vector or raw event, is filled in and passed to each\n"
+            "handler if it is given; otherwise each handler is passed a\n"
+            "new event vector.  Events are compressed as for\n"
+            "@code{x-next-event!}.  Returns the number of handlers\n"
+            "called.")
+#define FUNC_NAME s_scm_x_dispatch_events_x
+{
+  SCM display1;
+  xdisplay_t *dsp;
+  XEvent e;
+  int called = 0;
+
+  display1 = valid_dsp (display, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME);
+  dsp = XDISPLAY (display1);
+  validate_event_arg (event, SCM_ARG2, FUNC_NAME);
+
+  wait_for_event (display1, SCM_ARG1, FUNC_NAME);
+  XNextEvent (dsp->dsp, &e);
+
+  for (;;)
+    {
+      SCM proc;
+
+      compress_event (dsp, &e);
+
+      proc = find_event_handler (dsp, e.xany.window, e.type);
+      if (scm_is_true (proc))
+        {
+          scm_call_1 (proc, store_event (display1, &e, event, FUNC_NAME));
+          called++;
+        }
+
+      /* A window's last event: the server may hand out its XID again. */
+      if ((e.type == DestroyNotify) && (e.xdestroywindow.window == e.xdestroywindow.event))
+        remove_event_handlers (dsp, e.xdestroywindow.window);
+
+      /* A handler may have closed the display. */
+      if ((dsp->state != XDISPLAY_STATE_OPEN) ||
+          (XEventsQueued (dsp->dsp, QueuedAfterReading) == 0))
+        break;
+
+      XNextEvent (dsp->dsp, &e);
+    }
+
+  return scm_from_int (called);
+}
+#undef FUNC_NAME
+
 SCM_DEFINE (scm_x_check_mask_event_x, "x-check-mask-event!", 2, 1, 0,
             (SCM display,
              SCM mask,
@@ -2605,7 +7449,7 @@ SCM_DEFINE (scm_x_check_mask_event_x, "x-check-mask-event!", 2, 1, 0,
   validate_event_arg (event, SCM_ARG3, FUNC_NAME);
 
   if (XCheckMaskEvent (dsp->dsp, scm_to_int (mask), &e))
-    event = copy_event_fields (display1, &e, event, FUNC_NAME);
+    event = store_event (display1, &e, event, FUNC_NAME);
   else
     event = SCM_BOOL_F;
 
@@ -2630,7 +7474,7 @@ SCM_DEFINE (scm_x_check_typed_event_x, "x-check-typed-event!", 2, 1, 0,
   validate_event_arg (event, SCM_ARG3, FUNC_NAME);
 
   if (XCheckTypedEvent (dsp->dsp, scm_to_int (type), &e))
-    event = copy_event_fields (display1, &e, event, FUNC_NAME);
+    event = store_event (display1, &e, event, FUNC_NAME);
   else
     event = SCM_BOOL_F;
 
@@ -2657,7 +7501,7 @@ SCM_DEFINE (scm_x_check_typed_window_event_x, "x-check-typed-window-event!", 2,
   validate_event_arg (event, SCM_ARG3, FUNC_NAME);
 
   if (XCheckTypedWindowEvent (dsp->dsp, win->win, scm_to_int (type), &e))
-    event = copy_event_fields (display1, &e, event, FUNC_NAME);
+    event = store_event (display1, &e, event, FUNC_NAME);
   else
     event = SCM_BOOL_F;
 
@@ -2684,7 +7528,7 @@ SCM_DEFINE (scm_x_check_window_event_x, "x-check-window-event!", 2, 1, 0,
   validate_event_arg (event, SCM_ARG3, FUNC_NAME);
 
   if (XCheckWindowEvent (dsp->dsp, win->win, scm_to_int (mask), &e))
-    event = copy_event_fields (display1, &e, event, FUNC_NAME);
+    event = store_event (display1, &e, event, FUNC_NAME);
   else
     event = SCM_BOOL_F;
 
@@ -2692,6 +7536,61 @@ SCM_DEFINE (scm_x_check_window_event_x, "x-check-window-event!", 2, 1, 0,
 }
 #undef FUNC_NAME
 
+/* Return the XEventsQueued mode MODE, or DFLT if MODE is unbound. */
+static int valid_queued_mode (SCM mode, int pos, int dflt, const char *func)
+#define FUNC_NAME func
+{
+  int cmode;
+
+  if (SCM_UNBNDP (mode))
+    return dflt;
+
+  SCM_ASSERT (scm_is_integer (mode), mode, pos, func);
+  cmode = scm_to_int (mode);
+  SCM_ASSERT_RANGE (pos,
+                    mode,
+                    (cmode == QueuedAlready) ||
+                    (cmode == QueuedAfterReading) ||
+                    (cmode == QueuedAfterFlush));
+
+  return cmode;
+}
+#undef FUNC_NAME
+
+/* Wait until there is input on the connection to the display of ARG.
+   The wait is done in select rather than in Xlib, so that other Guile
+   threads and the collector can run meanwhile, and asyncs such as a
+   SIGINT handler run when it is interrupted.  They may close the
+   display, so ARG is checked again afterwards. */
+static void wait_for_input (SCM arg, int pos, const char *func)
+{
+  xdisplay_t *dsp;
+  fd_set fds;
+  int fd;
+
+  dsp = XDISPLAY (valid_dsp (arg, pos, XDISPLAY_STATE_OPEN, func));
+  fd = ConnectionNumber (dsp->dsp);
+  FD_ZERO (&fds);
+  FD_SET (fd, &fds);
+
+  if ((scm_std_select (fd + 1, &fds, NULL, NULL, NULL) < 0) && (errno != EINTR))
+    scm_syserror (func);
+
+  SCM_ASYNC_TICK;
+  valid_dsp (arg, pos, XDISPLAY_STATE_OPEN, func);
+}
+
+/* Wait until an event is queued for the display of ARG, flushing the
+   output buffer first, so that XNextEvent and XPeekEvent then return
+   without blocking. */
+static void wait_for_event (SCM arg, int pos, const char *func)
+{
+  xdisplay_t *dsp = XDISPLAY (valid_dsp (arg, pos, XDISPLAY_STATE_OPEN, func));
+
+  while (XEventsQueued (dsp->dsp, QueuedAfterFlush) == 0)
+    wait_for_input (arg, pos, func);
+}
+
 SCM_DEFINE (scm_x_events_queued_x, "x-events-queued!", 1, 1, 0,
             (SCM display,
              SCM mode),
@@ -2702,19 +7601,7 @@ SCM_DEFINE (scm_x_events_queued_x, "x-events-queued!", 1, 1, 0,
   int cmode;
 
   dsp = XDISPLAY (valid_dsp (display, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME));
-
-  if (!SCM_UNBNDP(mode))
-    {
-      SCM_ASSERT (scm_integer_p (mode), mode, SCM_ARG2, FUNC_NAME);
-      cmode = scm_to_int (mode);
-      SCM_ASSERT_RANGE (SCM_ARG2,
-                        mode,
-                        (cmode == QueuedAlready) ||
-                        (cmode == QueuedAfterReading) ||
-                        (cmode == QueuedAfterFlush));
-    }
-  else
-    cmode = QueuedAlready;
+  cmode = valid_queued_mode (mode, SCM_ARG2, QueuedAlready, FUNC_NAME);
 
   return scm_from_int (XEventsQueued (dsp->dsp, cmode));
 }
@@ -2743,15 +7630,18 @@ SCM_DEFINE (scm_x_mask_event_x, "x-mask-event!", 2, 1, 0,
   SCM display1;
   xdisplay_t *dsp;
   XEvent e;
+  long cmask;
 
   display1 = valid_dsp (display, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME);
   dsp = XDISPLAY (display1);
   SCM_ASSERT (scm_integer_p (mask), mask, SCM_ARG2, FUNC_NAME);
   validate_event_arg (event, SCM_ARG3, FUNC_NAME);
+  cmask = scm_to_int (mask);
 
-  XMaskEvent (dsp->dsp, scm_to_int (mask), &e);
+  while (!XCheckMaskEvent (dsp->dsp, cmask, &e))
+    wait_for_input (display1, SCM_ARG1, FUNC_NAME);
 
-  return copy_event_fields (display1, &e, event, FUNC_NAME);
+  return store_event (display1, &e, event, FUNC_NAME);
 }
 #undef FUNC_NAME
 
@@ -2769,9 +7659,64 @@ SCM_DEFINE (scm_x_next_event_x, "x-next-event!", 1, 1, 0,
   dsp = XDISPLAY (display1);
   validate_event_arg (event, SCM_ARG3, FUNC_NAME);
 
+  wait_for_event (display1, SCM_ARG1, FUNC_NAME);
   XNextEvent (dsp->dsp, &e);
+  compress_event (dsp, &e);
+
+  return store_event (display1, &e, event, FUNC_NAME);
+}
+#undef FUNC_NAME
+
+SCM_DEFINE (scm_x_next_events_x, "x-next-events!", 2, 1, 0,
+            (SCM display,
+             SCM events,
+             SCM mode),
+            "Move as many of the events queued for @var{display} as\n"
+            "there is room for into the vector @var{events}, in order,\n"
+            "and return how many there were.  Each element of\n"
+            "@var{events} that receives an event must be an event\n"
+            "vector or raw event, which is filled in, or @code{#f},\n"
+            "which is replaced by a new event vector.  The events are counted as\n"
+            "by @code{x-events-queued!} with @var{mode}, which defaults\n"
+            "to QueuedAfterReading, so this never waits for events to\n"
+            "arrive, and returns 0 if none have.")
+#define FUNC_NAME s_scm_x_next_events_x
+{
+  SCM display1;
+  xdisplay_t *dsp;
+  XEvent e;
+  int cmode, n, i;
+
+  display1 = valid_dsp (display, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME);
+  dsp = XDISPLAY (display1);
+  SCM_ASSERT (scm_is_simple_vector (events), events, SCM_ARG2, FUNC_NAME);
+  cmode = valid_queued_mode (mode, SCM_ARG3, QueuedAfterReading, FUNC_NAME);
+
+  n = XEventsQueued (dsp->dsp, cmode);
+  if (n > (int) SCM_SIMPLE_VECTOR_LENGTH (events))
+    n = SCM_SIMPLE_VECTOR_LENGTH (events);
+
+  /* Check the elements that will be filled in before taking any
+     events off the queue, so that none are lost on error. */
+  for (i = 0; i < n; i++)
+    if (scm_is_true (SCM_SIMPLE_VECTOR_REF (events, i)))
+      validate_event_arg (SCM_SIMPLE_VECTOR_REF (events, i), SCM_ARG2, FUNC_NAME);
+
+  /* Compression can take more than one event off the queue for each
+     one stored, so stop if it empties. */
+  for (i = 0; (i < n) && (XEventsQueued (dsp->dsp, QueuedAlready) > 0); i++)
+    {
+      SCM event = SCM_SIMPLE_VECTOR_REF (events, i);
+
+      XNextEvent (dsp->dsp, &e);
+      compress_event (dsp, &e);
+      event = store_event (display1, &e,
+                           scm_is_true (event) ? event : SCM_UNDEFINED,
+                           FUNC_NAME);
+      SCM_SIMPLE_VECTOR_SET (events, i, event);
+    }
 
-  return copy_event_fields (display1, &e, event, FUNC_NAME);
+  return scm_from_int (i);
 }
 #undef FUNC_NAME
 
@@ -2789,9 +7734,10 @@ SCM_DEFINE (scm_x_peek_event_x, "x-peek-event!", 1, 1, 0,
   dsp = XDISPLAY (display1);
   validate_event_arg (event, SCM_ARG3, FUNC_NAME);
 
+  wait_for_event (display1, SCM_ARG1, FUNC_NAME);
   XPeekEvent (dsp->dsp, &e);
 
-  return copy_event_fields (display1, &e, event, FUNC_NAME);
+  return store_event (display1, &e, event, FUNC_NAME);
 }
 #undef FUNC_NAME
 
@@ -2825,16 +7771,22 @@ SCM_DEFINE (scm_x_window_event_x, "x-window-event!", 2, 1, 0,
   xdisplay_t *dsp;
   xwindow_t *win;
   XEvent e;
+  long cmask;
 
   display1 = valid_dsp (window, SCM_ARG1, XDISPLAY_STATE_OPEN, FUNC_NAME);
   dsp = XDISPLAY (display1);
   win = valid_win (window, SCM_ARG1, ~XWINDOW_STATE_DESTROYED, FUNC_NAME);
   SCM_VALIDATE_NUMBER (SCM_ARG2, mask);
   validate_event_arg (event, SCM_ARG3, FUNC_NAME);
+  cmask = scm_to_int (mask);
 
-  XWindowEvent (dsp->dsp, win->win, scm_to_int (mask), &e);
+  while (!XCheckWindowEvent (dsp->dsp, win->win, cmask, &e))
+    {
+      wait_for_input (window, SCM_ARG1, FUNC_NAME);
+      win = valid_win (window, SCM_ARG1, ~XWINDOW_STATE_DESTROYED, FUNC_NAME);
+    }
 
-  return copy_event_fields (display1, &e, event, FUNC_NAME);
+  return store_event (display1, &e, event, FUNC_NAME);
 }
 #undef FUNC_NAME
 
@@ -2862,6 +7814,34 @@ init_xlib_core ()
   scm_set_smob_mark (scm_tc16_xgc, xgc_mark);
   scm_set_smob_print (scm_tc16_xgc, xgc_print);
 
+  scm_tc16_xfont = scm_make_smob_type ("x-font", sizeof (xfont_t));
+  scm_set_smob_free (scm_tc16_xfont, xfont_free);
+  scm_set_smob_mark (scm_tc16_xfont, xfont_mark);
+  scm_set_smob_print (scm_tc16_xfont, xfont_print);
+
+  scm_tc16_xtransform = scm_make_smob_type ("x-transform", sizeof (xform_t));
+  scm_set_smob_print (scm_tc16_xtransform, xtransform_print);
+
+  scm_tc16_xgeom = scm_make_smob_type ("x-geometry-buffer", sizeof (xgeom_t));
+  scm_set_smob_print (scm_tc16_xgeom, xgeom_print);
+
+  scm_tc16_xgcspec = scm_make_smob_type ("x-gc-spec", sizeof (xgcspec_t));
+  scm_set_smob_print (scm_tc16_xgcspec, xgcspec_print);
+
+  scm_tc16_xdctx = scm_make_smob_type ("x-draw-context", sizeof (xdctx_t));
+  scm_set_smob_mark (scm_tc16_xdctx, xdctx_mark);
+  scm_set_smob_print (scm_tc16_xdctx, xdctx_print);
+
+  scm_tc16_xevent = scm_make_smob_type ("x-raw-event", sizeof (xevent_t));
+  scm_set_smob_mark (scm_tc16_xevent, xevent_mark);
+  scm_set_smob_print (scm_tc16_xevent, xevent_print);
+
+  scm_tc16_xdlist = scm_make_smob_type ("x-display-list", sizeof (xdlist_t));
+  scm_set_smob_mark (scm_tc16_xdlist, xdlist_mark);
+  scm_set_smob_print (scm_tc16_xdlist, xdlist_print);
+
+  init_data_conversion ();
+
   /* A weak value hash table mapping known X resource IDs to
      corresponding smob instances.  This allows us to present the
      resource IDs in, e.g., X event data in a form that is useful on
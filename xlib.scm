@@ -37,6 +37,7 @@
 	x-screen-number-of-screen
 	x-min-colormaps
 	x-max-colormaps
+	x-scratch-statistics
 	x-create-window!
 	x-map-window!
 	x-unmap-window!
@@ -44,7 +45,10 @@
 	x-clear-window!
 	x-clear-area!
 	x-create-pixmap!
+	x-free-pixmap!
 	x-copy-area!
+	x-load-font!
+	x-unload-font!
 	x-default-gc
 	x-free-gc!
 	x-create-gc!
@@ -52,11 +56,43 @@
 	x-set-dashes!
 	x-set-clip-rectangles!
 	x-copy-gc!
+	x-make-gc-spec
+	x-apply-gc-spec!
+	x-get-gc-values
+	x-acquire-gc!
+	x-release-gc!
+	x-set-gc-pool-size!
+	x-make-transform
+	x-transform-set!
+	x-transform-identity!
+	x-transform-translate!
+	x-transform-scale!
+	x-transform-rotate!
+	x-transform->vector
+	x-set-gc-transform!
 	x-draw-arcs!
 	x-draw-lines!
 	x-draw-points!
 	x-draw-segments!
 	x-draw-rectangles!
+	x-fill-arcs!
+	x-fill-polygon!
+	x-fill-rectangles!
+	x-draw-batch!
+	x-make-draw-context
+	x-draw-context-set-gc!
+	x-context-draw!
+	x-make-geometry-buffer
+	x-geometry-buffer-push-point!
+	x-geometry-buffer-push-segment!
+	x-geometry-buffer-push-rectangle!
+	x-geometry-buffer-push-arc!
+	x-geometry-buffer-reset!
+	x-geometry-buffer-length
+	x-make-display-list
+	x-display-list-clear!
+	x-display-list-change-gc!
+	x-display-list-replay!
 	x-check-mask-event!
 	x-check-typed-event!
 	x-check-typed-window-event!
@@ -65,6 +101,12 @@
 	x-pending!
 	x-mask-event!
 	x-next-event!
+	x-next-events!
+	x-make-raw-event
+	x-event-ref
+	x-set-event-compression!
+	x-set-event-handler!
+	x-dispatch-events!
 	x-peek-event!
 	x-select-input!
 	x-window-event!)
@@ -179,7 +221,9 @@
 
 (define (x-event:slot-ref n)
   (lambda (event)
-    (vector-ref event n)))
+    (if (vector? event)
+        (vector-ref event n)
+        (x-event-ref event n))))
 
 (define-public x-event:type                    (x-event:slot-ref 0))
 (define-public x-event:serial                  (x-event:slot-ref 1))
@@ -336,8 +380,9 @@
 ;;; Convenience procedures to set a single GC field.
 
 (define (x-gc-setter field)
-  (lambda (gc value)
-    (x-change-gc! gc field value)))
+  (let ((spec (x-make-gc-spec field)))
+    (lambda (gc value)
+      (x-apply-gc-spec! gc spec value))))
 
 (define-public x-set-function!                 (x-gc-setter GCFunction))
 (define-public x-set-plane-mask!               (x-gc-setter GCPlaneMask))
@@ -365,33 +410,45 @@
 
 ;;; Convenience procedures to set useful combinations of GC fields.
 
+(define clip-origin-spec
+  (x-make-gc-spec GCClipXOrigin GCClipYOrigin))
+
 (define-public (x-set-clip-origin! gc x y)
-  (x-change-gc! gc
-                GCClipXOrigin x
-                GCClipYOrigin y))
+  (x-apply-gc-spec! gc clip-origin-spec x y))
+
+(define line-attributes-spec
+  (x-make-gc-spec GCLineWidth GCLineStyle GCCapStyle GCJoinStyle))
 
 (define-public (x-set-line-attributes! gc width style cap-style join-style)
-  (x-change-gc! gc
-                GCLineWidth width
-                GCLineStyle style
-                GCCapStyle cap-style
-                GCJoinStyle join-style))
+  (x-apply-gc-spec! gc line-attributes-spec width style cap-style join-style))
+
+(define ts-origin-spec
+  (x-make-gc-spec GCTileStipXOrigin GCTileStipYOrigin))
 
 (define-public (x-set-ts-origin! gc x y)
-  (x-change-gc! gc
-                GCTileStipXOrigin x
-                GCTileStipYOrigin y))
+  (x-apply-gc-spec! gc ts-origin-spec x y))
+
+(define state-spec
+  (x-make-gc-spec GCForeground GCBackground GCFunction GCPlaneMask))
 
 (define-public (x-set-state! gc foreground background function plane-mask)
-  (x-change-gc! gc
-                GCForeground foreground
-                GCBackground background
-                GCFunction function
-                GCPlaneMask plane-mask))
+  (x-apply-gc-spec! gc state-spec foreground background function plane-mask))
 
 
 ;;; {Drawing}
 
+;;; Polygon shape values for x-fill-polygon!.
+
+(define-public Complex                          0)
+(define-public Nonconvex                        1)
+(define-public Convex                           2)
+
+;;; Coordinate modes for the #:mode option of x-draw-lines!,
+;;; x-draw-points! and x-fill-polygon!.
+
+(define-public CoordModeOrigin                  0)
+(define-public CoordModePrevious                1)
+
 ;;; guile-xlib has primitives for the multiple arc/line/etc. versions
 ;;; of the following.  Here we define-public the single
 ;;; arc/line/etc. procedures in terms of those primitives.
@@ -430,6 +487,24 @@
     (array-set! rectangles height 0 3)
     (x-draw-rectangles! window gc rectangles)))
 
+(define-public (x-fill-arc! window gc x y width height angle1 angle2)
+  (let ((arcs (make-typed-array 's16 0 1 6)))
+    (array-set! arcs x      0 0)
+    (array-set! arcs y      0 1)
+    (array-set! arcs width  0 2)
+    (array-set! arcs height 0 3)
+    (array-set! arcs angle1 0 4)
+    (array-set! arcs angle2 0 5)
+    (x-fill-arcs! window gc arcs)))
+
+(define-public (x-fill-rectangle! window gc x y width height)
+  (let ((rectangles (make-typed-array 's16 0 1 4)))
+    (array-set! rectangles x      0 0)
+    (array-set! rectangles y      0 1)
+    (array-set! rectangles width  0 2)
+    (array-set! rectangles height 0 3)
+    (x-fill-rectangles! window gc rectangles)))
+
 
 ;;; {Event Loop}
 